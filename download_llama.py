@@ -22,9 +22,9 @@ def get_models(args: argparse.Namespace):
         "-m",
         "onnxruntime.transformers.models.llama.convert_to_onnx",
         "-m",
-        "meta-llama/Llama-2-7b-hf",
+        args.model_name,
         "--output",
-        "llama2-7b-fp32-cpu",
+        os.path.join(args.output_folder, args.model_name),
         "--precision",
         "fp32",
         "--execution_provider",
@@ -35,7 +35,7 @@ void BeamHypotheses::Add(std::span<const int32_t> hypothesis, float sum_logprobs
 
 bool BeamHypotheses::CanImprove(float best_sum_logprobs, int current_length) const {
   float current_score = best_sum_logprobs / pow(static_cast<float>(current_length), length_penalty_);
-  return beams_.back().score < current_score;
+  return beams_.data()[beams_used_ - 1].score < current_score;  // With pruned beams, the array might not be full
 }
 
 void BeamHypotheses::Output(
@@ -44,15 +44,21 @@ void BeamHypotheses::Output(
     std::span<int32_t> sequences,       // buffer filled with pad token ID, shape (num_return_sequences, max_length)
     std::span<float> sequences_scores)  // buffer of shape (num_return_sequences) or empty
 {
-  // Copy the top_k beams into the sequences
-  assert(top_k <= beams_used_);
+  // Copy the top_k beams into the sequences. Pruning can leave fewer hypotheses than top_k, the sequences past them stay
+  // padding with a score of -infinity.
   for (int index = 0; index < top_k; index++) {
+    if (index >= beams_used_) {
+      if (!sequences_scores.empty())
+        sequences_scores[index] = -std::numeric_limits<float>::infinity();
+      continue;
+    }
+
     auto& item = beams_[index];
     std::span<int32_t> target = sequences.subspan(index * max_length, max_length);
 
     // Note that word_ids might be less than max_length.
     // Since the sequences has been filled with pad token ID, so padding is not needed here.
-    copy(item.hypothesis, target);
+    copy(item.hypothesis, target.subspan(0, item.hypothesis.size()));
 
     if (!sequences_scores.empty())
       sequences_scores[index] = item.score;
@@ -66,18 +72,23 @@ BeamSearchScorer::BeamSearchScorer(const SearchParams& parameters)
       pad_token_id_{parameters.pad_token_id},
       eos_token_id_{parameters.eos_token_id},
       early_stopping_{parameters.early_stopping},
-      not_done_count_{parameters.batch_size} {
+      not_done_count_{parameters.batch_size},
+      prune_relative_{parameters.beam_prune_relative},
+      prune_absolute_{parameters.beam_prune_absolute} {
   size_t batch_beam_size = batch_size_ * num_beams_;
 
   std::span<HypothesisScore> beams;
   hypothesis_scores_ptr_ = AllocateArray<HypothesisScore>(batch_beam_size, &beams);
   beam_hyps_ptr_ = AllocateArray<BeamHypotheses>(batch_size_, &beam_hyps_);
+  auto length_penalties = parameters.length_penalties;
   for (size_t i = 0; i < batch_size_; i++)
-    beam_hyps_[i].Init(parameters.length_penalty, beams.subspan(i * num_beams_, num_beams_));
+    beam_hyps_[i].Init(length_penalties.empty() ? parameters.length_penalty : length_penalties[i], beams.subspan(i * num_beams_, num_beams_));
 
   next_beam_scores_ptr_ = AllocateArray<float>(batch_beam_size, &next_beam_scores_);
   next_beam_tokens_ptr_ = AllocateArray<int32_t>(batch_beam_size, &next_beam_tokens_);
   next_beam_indices_ptr_ = AllocateArray<int32_t>(batch_beam_size, &next_beam_indices_);
+  active_beams_ptr_ = AllocateArray<int>(batch_size_, &active_beams_);
+  std::fill(active_beams_.begin(), active_beams_.end(), num_beams_);
 
   // Space to store intermediate sequence with length sequence_length, sequence_length + 1, ..., max_sequence_length.
   size_t per_beam = (max_length_ * (max_length_ + 1) - (parameters.sequence_length - 1) * parameters.sequence_length) / 2;
@@ -98,7 +109,8 @@ BeamSearchScorer::BeamSearchScorer(const SearchParams& parameters)
 void BeamSearchScorer::Process(Sequences& sequences,
                                std::span<const ScoreType> next_scores,
                                std::span<const int32_t> next_tokens,
-                               std::span<const int32_t> next_indices) {
+                               std::span<const int32_t> next_indices,
+                               std::span<const bool> next_stops) {
   // Sequences shape is (batch_size * num_beams, total_sequence_length)
   // It contains word ID of whole sequence generated so far.
   // It is different from subgraph input_ids, which only need one word when past state is not empty.
@@ -111,7 +123,7 @@ void BeamSearchScorer::Process(Sequences& sequences,
   for (size_t batch = 0; batch < batch_size_; batch++) {
     BeamHypotheses& beam_hyp = beam_hyps_[batch];
     if (beam_hyp.done_) {
-      assert(beam_hyp.beams_used_ == num_beams_);  // Batch can only be done if all beams have been generated
+      assert(beam_hyp.beams_used_ >= active_beams_[batch]);  // Batch can only be done if all beams have been generated
 
       // Pad the batch.
       for (size_t j = 0; j < num_beams_; j++) {
@@ -123,6 +135,7 @@ void BeamSearchScorer::Process(Sequences& sequences,
     }
 
     // Next tokens for this sentence.
+    size_t active_beams = active_beams_[batch];
     size_t beam_idx = 0;
     size_t top_k = 2 * num_beams_;
     for (size_t j = 0; j < top_k; j++) {
@@ -132,18 +145,23 @@ void BeamSearchScorer::Process(Sequences& sequences,
 
       int batch_beam_idx = static_cast<int>(batch * num_beams_) + next_index;
       // Add to generated hypotheses if end of sentence.
-      if ((eos_token_id_ >= 0) && (next_token == eos_token_id_)) {
-        bool is_beam_token_worse_than_top_num_beams = (j >= num_beams_);
+      bool stop = !next_stops.empty() && next_stops[batch * top_k + j];
+      if (((eos_token_id_ >= 0) && (next_token == eos_token_id_)) || stop) {
+        bool is_beam_token_worse_than_top_num_beams = (j >= active_beams);
         if (is_beam_token_worse_than_top_num_beams) {
           continue;
         }
 
-        // Clone the sequence and append to buffer.
+        // Clone the sequence and append to buffer. EOS isn't kept, but a stop sequence is, as greedy search keeps it, so
+        // its last token is appended.
         std::span<const int32_t> src = sequences.GetSequence(batch_beam_idx);
-        auto clone = hypothesis_buffer_.subspan(static_cast<size_t>(hypothesis_buffer_used_), sequence_length);
+        bool keep_token = !((eos_token_id_ >= 0) && (next_token == eos_token_id_));
+        auto clone = hypothesis_buffer_.subspan(static_cast<size_t>(hypothesis_buffer_used_), sequence_length + keep_token);
 
-        copy(src, clone);
-        hypothesis_buffer_used_ += sequence_length;
+        copy(src, clone.subspan(0, sequence_length));
+        if (keep_token)
+          clone[sequence_length] = next_token;
+        hypothesis_buffer_used_ += static_cast<int>(clone.size());
         beam_hyp.Add(clone, next_score);
       } else {
         // Add next predicted token since it is not eos_token.
@@ -154,15 +172,34 @@ void BeamSearchScorer::Process(Sequences& sequences,
       }
 
       // Once the beam for next step is full, don't add more tokens to it.
-      if (beam_idx == num_beams_)
+      if (beam_idx == active_beams)
         break;
     }
 
-    assert(beam_idx == num_beams_);
+    assert(beam_idx == active_beams);
     assert(static_cast<size_t>(hypothesis_buffer_used_) <= hypothesis_buffer_.size());
 
+    // Retire the beams too far behind the best, they were added best first so they're the last ones. The best never is.
+    float best_score = next_beam_scores_[batch * num_beams_];
+    float relative_threshold = prune_relative_ > 0.0f ? best_score + std::log(prune_relative_) : -std::numeric_limits<float>::infinity();
+    float absolute_threshold = prune_absolute_ > 0.0f ? best_score - prune_absolute_ : -std::numeric_limits<float>::infinity();
+    while (active_beams > 1) {
+      float score = next_beam_scores_[batch * num_beams_ + active_beams - 1];
+      if (score >= relative_threshold && score >= absolute_threshold)
+        break;
+      active_beams--;
+    }
+    active_beams_[batch] = static_cast<int>(active_beams);
+
+    // The retired beams are padded, they're no longer run
+    for (size_t j = active_beams; j < num_beams_; j++) {
+      next_beam_scores_[batch * num_beams_ + j] = 0.0f;
+      next_beam_tokens_[batch * num_beams_ + j] = pad_token_id_;
+      next_beam_indices_[batch * num_beams_ + j] = static_cast<int32_t>(batch * num_beams_);
+    }
+
     //  Check if we are done so that we can save a pad step if all(done)
-    if (static_cast<size_t>(beam_hyp.beams_used_) < num_beams_)
+    if (static_cast<size_t>(beam_hyp.beams_used_) < active_beams)
       continue;
 
     if (!early_stopping_) {
@@ -191,7 +228,7 @@ void BeamSearchScorer::Finalize(Sequences& sequences,
       continue;
     }
 
-    for (int beam_index = 0; beam_index < num_beams_; beam_index++) {
+    for (int beam_index = 0; beam_index < active_beams_[batch_index]; beam_index++) {
       int batch_beam_index = batch_index * num_beams_ + beam_index;
       float final_score = next_beam_scores_[batch_beam_index];
       auto final_tokens = sequences.GetSequence(batch_beam_index);
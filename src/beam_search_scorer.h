@@ -34,10 +34,12 @@ struct BeamHypotheses {
 struct BeamSearchScorer {
   BeamSearchScorer(const SearchParams& parameters);
 
+  // 'next_stops' optionally marks the candidates that complete a stop sequence, they're finished like EOS
   void Process(Sequences& sequences,
                std::span<const float> next_scores,
                std::span<const int32_t> next_tokens,
-               std::span<const int32_t> next_indices);
+               std::span<const int32_t> next_indices,
+               std::span<const bool> next_stops = {});
 
   void Finalize(Sequences& sequences,
                 size_t num_return_sequences,
@@ -45,6 +47,8 @@ struct BeamSearchScorer {
                 std::span<float> output_sequence_scores);
 
   bool IsDone() const { return not_done_count_ == 0; }
+  bool IsDone(size_t batch_index) const { return beam_hyps_.data()[batch_index].done_; }
+  int GetActiveBeamCount(size_t batch_index) { return active_beams_[batch_index]; }
 
   std::span<float> GetNextScores() { return next_beam_scores_; }
   std::span<int32_t> GetNextTokens() { return next_beam_tokens_; }
@@ -58,6 +62,12 @@ struct BeamSearchScorer {
   int eos_token_id_;
   bool early_stopping_;
   int not_done_count_;  // When zero, every batch entry is done (starts at batch_size_)
+  float prune_relative_;
+  float prune_absolute_;
+
+  // Beams still searched of each batch entry, only goes down as beams are pruned. They're the first of the entry's beams.
+  std::unique_ptr<int[]> active_beams_ptr_;
+  std::span<int> active_beams_;
 
   std::unique_ptr<float[]> next_beam_scores_ptr_;
   std::span<float> next_beam_scores_;
@@ -24,6 +24,8 @@
 namespace Generators {
 using ScoreType = float;
 
+struct StopSequences;
+
 enum struct DeviceType {
   Auto,
   CPU,
@@ -45,9 +47,41 @@ struct SearchParams {
   float length_penalty{1.0f};
   bool early_stopping{};
 
-  int BatchBeamSize() const { return num_beams * batch_size; }
+  // Adaptive beam pruning, 0 turns either off. A beam is retired once its probability is below beam_prune_relative times
+  // the best beam's of its batch entry, or its log probability is more than beam_prune_absolute below the best's. Its row
+  // is dropped from the model batch and the batch entry carries on with fewer beams.
+  float beam_prune_relative{};
+  float beam_prune_absolute{};
+
+  // Optional, a row is done once it generates one of these (the same as its EOS). Built once and shared by every search
+  // that uses it.
+  const StopSequences* stop_sequences{};
+
+  // Classifier-free guidance, greedy search only. If the scale isn't 1, the model runs the unconditional prompts as a
+  // second half of the batch and the search combines the two halves' scores (see Search::GetModelParams).
+  float guidance_scale{1.0f};
+
+  // Greedy search or sampling only, the completions of each prompt. The model state prefills each prompt once and copies
+  // its past state into every completion's row, so n completions cost one prefill (see Search::GetModelParams). Each row
+  // then holds its own full copy of the prompt's past state.
+  int num_return_sequences{1};
+
+  int RowsPerPrompt() const { return num_beams * num_return_sequences; }
+  int BatchBeamSize() const { return RowsPerPrompt() * batch_size; }
 
   std::span<const int32_t> input_ids;  // Array of [batchsize][sequence_length]
+  std::span<const int32_t> unconditional_input_ids;  // Array of [batchsize][sequence_length], for guidance
+
+  // Optional settings of each batch entry, each of shape [batchsize]. Where given they replace the single setting for the
+  // whole batch, so requests with different settings can share a batch.
+  std::span<const int32_t> max_lengths;         // Greedy search or sampling, none past max_length (which sizes the buffers)
+  std::span<const float> length_penalties;      // Beam search
+  std::span<const int32_t> min_lengths;         // Processors::MinLength
+  std::span<const float> repetition_penalties;  // Processors::RepetitionPenalty
+  std::span<const float> temperatures;          // The samplers
+  std::span<const int32_t> top_ks;              // GreedySearch::SampleTopK
+  std::span<const float> top_ps;                // GreedySearch::SampleTopP
+  std::span<const uint32_t> seeds;              // The samplers, otherwise each row is seeded from std::random_device
 };
 
 void top_k_indices(std::span<int32_t> top_k, std::span<const ScoreType> inputs);
@@ -0,0 +1,143 @@
+#include "../generators.h"
+#include "onnxruntime_cxx_api_2.h"
+#include "gpt_common.h"
+#include "gpt_engine.h"
+#include "gpt_async.h"
+#include <thread>
+
+namespace Generators {
+
+Gpt_Task& Gpt_Task::operator=(Gpt_Task&& other) noexcept {
+  if (this != &other) {
+    if (handle_)
+      handle_.destroy();
+    handle_ = std::exchange(other.handle_, {});
+  }
+  return *this;
+}
+
+Gpt_Task::~Gpt_Task() {
+  if (handle_)
+    handle_.destroy();
+}
+
+void Gpt_Task::promise_type::FinalAwaiter::await_suspend(std::coroutine_handle<promise_type> handle) noexcept {
+  auto* scheduler = handle.promise().scheduler_;
+  handle.destroy();
+  scheduler->TaskDone();
+}
+
+void Gpt_TokenAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  scheduler_.Wait(request_, handle);
+}
+
+std::optional<int32_t> Gpt_TokenAwaiter::await_resume() {
+  if (!taken_) {
+    taken_ = request_.TakeToken(token_);
+    assert(taken_);  // Only resumed once the request is ready
+  }
+  return token_;
+}
+
+Gpt_Scheduler::Gpt_Scheduler(const Gpt_Model& model, int max_batch_size, int max_length)
+    : engine_{model, max_batch_size, max_length} {
+}
+
+void Gpt_Scheduler::Spawn(Gpt_Task task) {
+  // The scheduler owns the coroutine from here, it's destroyed when it finishes (see FinalAwaiter)
+  auto handle = std::exchange(task.handle_, {});
+  handle.promise().scheduler_ = this;
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  task_count_++;
+  ready_.push_back(handle);
+  ready_condition_.notify_one();
+}
+
+std::shared_ptr<Gpt_Request> Gpt_Scheduler::Add(const SearchParams& params) {
+  auto request = std::make_shared<Gpt_Request>(params);
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  added_.push_back(request);
+  step_condition_.notify_one();
+  return request;
+}
+
+void Gpt_Scheduler::Wait(Gpt_Request& request, std::coroutine_handle<> handle) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  // The token could have arrived since the awaiter checked
+  if (request.IsReady()) {
+    ready_.push_back(handle);
+    ready_condition_.notify_one();
+  } else
+    waiting_.emplace_back(&request, handle);
+}
+
+void Gpt_Scheduler::TaskDone() {
+  std::lock_guard<std::mutex> lock{mutex_};
+  task_count_--;
+  step_condition_.notify_one();
+}
+
+void Gpt_Scheduler::WorkerThread() {
+  while (true) {
+    std::coroutine_handle<> handle;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      ready_condition_.wait(lock, [this] { return !ready_.empty() || !running_; });
+      if (ready_.empty())
+        return;
+      handle = ready_.front();
+      ready_.pop_front();
+    }
+    handle.resume();
+  }
+}
+
+void Gpt_Scheduler::Run(int thread_count) {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    running_ = true;
+  }
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < thread_count; i++)
+    threads.emplace_back(&Gpt_Scheduler::WorkerThread, this);
+
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      for (auto& request : added_)
+        engine_.Add(std::move(request));
+      added_.clear();
+    }
+
+    bool stepped = engine_.Step();
+
+    std::unique_lock<std::mutex> lock{mutex_};
+    // Resume the coroutines whose token is ready
+    auto ready = std::stable_partition(waiting_.begin(), waiting_.end(), [](auto& waiting) { return !waiting.first->IsReady(); });
+    for (auto it = ready; it != waiting_.end(); ++it)
+      ready_.push_back(it->second);
+    if (ready != waiting_.end())
+      ready_condition_.notify_all();
+    waiting_.erase(ready, waiting_.end());
+
+    if (task_count_ == 0)
+      break;
+
+    // With nothing to run, wait for a coroutine to add a request (or to finish)
+    if (!stepped)
+      step_condition_.wait(lock, [this] { return !added_.empty() || task_count_ == 0; });
+  }
+
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    running_ = false;
+    ready_condition_.notify_all();
+  }
+  for (auto& thread : threads)
+    thread.join();
+}
+
+}  // namespace Generators
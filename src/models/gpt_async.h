@@ -0,0 +1,94 @@
+#pragma once
+#include <condition_variable>
+#include <coroutine>
+#include <utility>
+
+namespace Generators {
+
+struct Gpt_Scheduler;
+
+// Return type of a generation coroutine, started by Gpt_Scheduler::Spawn. For example:
+//
+//   Gpt_Task Generate(Gpt_Scheduler& scheduler, const SearchParams& params, std::vector<int32_t>& tokens) {
+//     auto request = scheduler.Add(params);
+//     while (auto token = co_await scheduler.NextToken(*request))
+//       tokens.push_back(*token);
+//   }
+struct Gpt_Task {
+  struct promise_type {
+    Gpt_Task get_return_object() { return Gpt_Task{std::coroutine_handle<promise_type>::from_promise(*this)}; }
+    std::suspend_always initial_suspend() noexcept { return {}; }  // Started by the scheduler
+
+    // Destroys the coroutine then lets the scheduler know it finished
+    struct FinalAwaiter {
+      bool await_ready() noexcept { return false; }
+      void await_suspend(std::coroutine_handle<promise_type> handle) noexcept;
+      void await_resume() noexcept {}
+    };
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void return_void() {}
+    void unhandled_exception() { std::terminate(); }
+
+    Gpt_Scheduler* scheduler_{};
+  };
+
+  explicit Gpt_Task(std::coroutine_handle<promise_type> handle) : handle_{handle} {}
+  Gpt_Task(Gpt_Task&& other) noexcept : handle_{std::exchange(other.handle_, {})} {}
+  Gpt_Task& operator=(Gpt_Task&& other) noexcept;
+  Gpt_Task(const Gpt_Task&) = delete;
+  Gpt_Task& operator=(const Gpt_Task&) = delete;
+  ~Gpt_Task();  // Destroys the coroutine if it was never spawned, once spawned it destroys itself when it finishes
+
+  std::coroutine_handle<promise_type> handle_;  // Null once handed to the scheduler
+};
+
+// Awaited to get a request's next token, suspends the coroutine until the engine has generated it
+struct Gpt_TokenAwaiter {
+  Gpt_TokenAwaiter(Gpt_Scheduler& scheduler, Gpt_Request& request) : scheduler_{scheduler}, request_{request} {}
+
+  bool await_ready() { return taken_ = request_.TakeToken(token_); }
+  void await_suspend(std::coroutine_handle<> handle);
+  std::optional<int32_t> await_resume();  // Empty once the request is done
+
+  Gpt_Scheduler& scheduler_;
+  Gpt_Request& request_;
+  std::optional<int32_t> token_;
+  bool taken_{};
+};
+
+// Runs many generation coroutines over a Gpt_Engine with a few threads. The calling thread of Run steps the engine,
+// the coroutines are resumed on worker threads whenever the token they wait on is ready.
+struct Gpt_Scheduler {
+  Gpt_Scheduler(const Gpt_Model& model, int max_batch_size, int max_length);
+
+  void Spawn(Gpt_Task task);  // The coroutine first runs once Run is called
+
+  // Steps the engine and resumes the coroutines on 'thread_count' worker threads, until every coroutine has finished
+  void Run(int thread_count);
+
+  // For the coroutines
+  std::shared_ptr<Gpt_Request> Add(const SearchParams& params);  // Joins the engine before its next step
+  Gpt_TokenAwaiter NextToken(Gpt_Request& request) { return Gpt_TokenAwaiter{*this, request}; }
+
+ private:
+  friend struct Gpt_TokenAwaiter;
+  friend struct Gpt_Task::promise_type::FinalAwaiter;
+
+  void Wait(Gpt_Request& request, std::coroutine_handle<> handle);
+  void TaskDone();
+  void WorkerThread();
+
+  Gpt_Engine engine_;
+
+  std::mutex mutex_;
+  std::condition_variable ready_condition_;  // Signalled when a coroutine is ready to resume, or Run has finished
+  std::condition_variable step_condition_;   // Signalled when a request is added, or a coroutine has finished
+  std::deque<std::coroutine_handle<>> ready_;
+  std::vector<std::pair<Gpt_Request*, std::coroutine_handle<>>> waiting_;  // Coroutines waiting on a request's token
+  std::vector<std::shared_ptr<Gpt_Request>> added_;                        // Requests to add to the engine
+  int task_count_{};                                                       // Spawned coroutines that haven't finished
+  bool running_{};
+};
+
+}  // namespace Generators
@@ -7,10 +7,32 @@
 
 namespace Generators {
 
+static bool HasOutput(const OrtSession& session, const char* name) {
+  auto names = session.GetOutputNames();
+  return std::find(names.begin(), names.end(), name) != names.end();
+}
+
 Gpt_Model::Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path)
+    : Gpt_Model(ort_env, decoder_path, *OrtSessionOptions::Create()) {
+}
+
+Gpt_Model::Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, const OrtSessionOptions& session_options)
+    : Gpt_Model(ort_env, decoder_path, nullptr, session_options) {
+}
+
+Gpt_Model::Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, const ORTCHAR_T* init_decoder_path, const OrtSessionOptions& session_options)
     : device_type_{DeviceType::CPU} {
-  auto session_options = OrtSessionOptions::Create();
-  session_decoder_ = OrtSession::Create(ort_env, decoder_path, session_options.get());
+  session_decoder_ = OrtSession::Create(ort_env, decoder_path, &session_options);
+  if (init_decoder_path)
+    session_init_decoder_ = OrtSession::Create(ort_env, init_decoder_path, &session_options);
+  InitModelParams();
+}
+
+Gpt_Model::Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, const OrtSessionOptions& session_options, const OrtSessionOptions& prefill_session_options)
+    : device_type_{DeviceType::CPU} {
+  prepacked_weights_ = OrtPrepackedWeightsContainer::Create();
+  session_decoder_ = OrtSession::Create(ort_env, decoder_path, &session_options, *prepacked_weights_);
+  session_prefill_ = OrtSession::Create(ort_env, decoder_path, &prefill_session_options, *prepacked_weights_);
   InitModelParams();
 }
 
@@ -31,16 +53,27 @@ Gpt_Model::Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, cudaStream_
 #endif
 
   void Gpt_Model::InitModelParams() {
+    allocator_cpu_ = &Ort::Allocator::GetWithDefaultOptions();
+
     // We could use this to determine the vocabulary size and if the logits has a width of 1
     auto logits_shape = session_decoder_->GetOutputTypeInfo(0)->GetTensorTypeAndShapeInfo().GetShape();
     assert(logits_shape.size() == 3);
     logits_uses_seq_len_ = logits_shape[1] == -1;
     vocab_size_ = static_cast<int>(logits_shape[2]);
-    layer_count_ = static_cast<int>(session_decoder_->GetOutputCount()) - 1;
+    has_last_logits_ = HasOutput(*session_decoder_, "last_logits");
+    layer_count_ = static_cast<int>(session_decoder_->GetOutputCount()) - 1 - has_last_logits_;
 
     auto past_shape = session_decoder_->GetInputTypeInfo(3)->GetTensorTypeAndShapeInfo().GetShape();
     head_count_ = static_cast<int>(past_shape[2]);
     hidden_size_ = static_cast<int>(past_shape[4]);
+
+    if (session_init_decoder_) {
+      auto init_logits_shape = session_init_decoder_->GetOutputTypeInfo(0)->GetTensorTypeAndShapeInfo().GetShape();
+      init_logits_uses_seq_len_ = init_logits_shape[1] == -1;
+      init_has_last_logits_ = HasOutput(*session_init_decoder_, "last_logits");
+      assert(session_init_decoder_->GetInputCount() == 3 + static_cast<size_t>(layer_count_));
+      assert(session_init_decoder_->GetOutputCount() == 1 + init_has_last_logits_ + static_cast<size_t>(layer_count_));
+    }
   }
 
 }  // namespace Generators
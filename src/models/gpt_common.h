@@ -2,8 +2,22 @@
 
 namespace Generators {
 
+// The loaded model, running it doesn't change it. All of a generation's state lives in a Gpt_State, so one model can be
+// shared by any number of states running concurrently on different threads (OrtSession::Run is thread safe). On CUDA the
+// states share the model's stream, so their runs are serialized on it.
 struct Gpt_Model {
   Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path);
+  Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, const OrtSessionOptions& session_options);  // CPU, with custom session options
+
+  // CPU, with an init decoder for the first run. It runs the prompt with an empty past, so it takes the same past inputs
+  // as the decoder, and its presents become the decoder's past. An init decoder exported without past inputs isn't
+  // supported.
+  Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, const ORTCHAR_T* init_decoder_path, const OrtSessionOptions& session_options);
+
+  // CPU, with a second session of the decoder that runs the prefills, with its own session options and so its own thread
+  // pool (for disaggregated prefill, see Gpt_Engine). Both sessions are created with one prepacked weights container, so
+  // they share the prepacked weights rather than each holding a copy.
+  Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, const OrtSessionOptions& session_options, const OrtSessionOptions& prefill_session_options);
 #ifdef USE_CUDA
   Gpt_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, cudaStream_t cuda_stream);
   cudaStream_t cuda_stream_;
@@ -12,7 +26,14 @@ struct Gpt_Model {
   DeviceType GetDeviceType() const { return device_type_; }
   int GetVocabSize() const { return vocab_size_; }
 
+  std::unique_ptr<OrtPrepackedWeightsContainer> prepacked_weights_;  // Shared by the decoder and prefill sessions, outlives them
   std::unique_ptr<OrtSession> session_decoder_;
+  std::unique_ptr<OrtSession> session_init_decoder_;  // Optional, runs the first prompt chunk
+  std::unique_ptr<OrtSession> session_prefill_;       // Optional, runs the prefill (but not the init decoder's chunk)
+
+  // Allocator the CPU states create their tensors with, it can be replaced before creating a state (to track allocations).
+  // Every state uses it, so it must be thread safe if the states run on different threads.
+  OrtAllocator* allocator_cpu_{};
 
   // Model parameters:
   int vocab_size_{};
@@ -20,6 +41,12 @@ struct Gpt_Model {
   int hidden_size_{};
   int layer_count_{};
   bool logits_uses_seq_len_{};  // Logits shape is [... seq_len, vocab_size ] vs [... 1, vocab_size ]
+  bool init_logits_uses_seq_len_{};
+
+  // A model with logits for every position can also have a 'last_logits' output, shape (batch_size, 1, vocab_size), with
+  // only the last position's. The prefill then fetches it and not the logits of every prompt position.
+  bool has_last_logits_{};
+  bool init_has_last_logits_{};
 
  private:
   void InitModelParams();
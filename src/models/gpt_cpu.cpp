@@ -2,101 +2,92 @@
 #include "../search.h"
 #include "gpt_cpu.h"
 #include "debugging.h"
+#include "model_rows.h"
 #include <iostream>
 
 namespace Generators {
 
-template <typename T>
-static void ExpandInputs(const OrtValue& input, int num_beams, OrtAllocator& allocator, std::unique_ptr<OrtValue>& expanded) {
-  // Input shape (batch_size, sequence_length). The input is required with data type T.
-  // Output shape (batch_size * num_beams, sequence_length)
-
-  auto input_type_info = input.GetTensorTypeAndShapeInfo();
-  auto input_shape = input_type_info->GetShape();
-  const int64_t batch_size = input_shape[0];
-  const int64_t sequence_length = input_shape[1];
-
-  int64_t dims[] = {batch_size * num_beams, sequence_length};
-
-  auto element_type = input_type_info->GetElementType();
-  assert(element_type == Ort::TypeToTensorType<T>::type);
-
-  expanded = OrtValue::CreateTensor<T>(allocator, dims, std::size(dims));
-
-  const T* input_data = input.GetTensorData<T>();
-  T* expanded_data = expanded->GetTensorMutableData<T>();
-  T* target = expanded_data;
-  for (int i = 0; i < batch_size; i++) {
-    for (int j = 0; j < num_beams; j++) {
-      memcpy(target, input_data + i * sequence_length, sizeof(T) * sequence_length);
-      target += sequence_length;
-    }
-  }
-}
-
-Gpt_State::Gpt_State(Gpt_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& search_params)
- : model_{&model},
-  search_params_{search_params} {
+Gpt_State::Gpt_State(const Gpt_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& search_params, int prefill_chunk_size)
+ : search_params_{search_params},
+  model_{&model},
+  allocator_{*model.allocator_cpu_},
+  memory_info_{*allocator_.Info(&allocator_)},
+  prefill_chunk_size_{prefill_chunk_size > 0 ? std::min(prefill_chunk_size, search_params.sequence_length) : search_params.sequence_length} {
 
+  // The prompt is the same for every beam (or returned sequence), so it's run once per batch row and broadcast to the
+  // row's beams afterwards
   int64_t input_ids_shape[] = {search_params_.batch_size, search_params_.sequence_length};
+  int64_t batch_size = search_params_.batch_size;
+  int64_t batch_beam_size = search_params_.BatchBeamSize();
 
   // Allocate position_ids and attention_mask based on shape of input_ids
   auto element_type = Ort::TypeToTensorType<int32_t>::type;
-  auto& allocator = Ort::Allocator::GetWithDefaultOptions();
-
-  const OrtMemoryInfo& location = allocator.GetInfo();
+  auto& allocator = allocator_;
 
   // Use original input_ids. This requires the input_ids for subgraph is also int32.
   // Current shape is (batch_size, sequence_length)
-  // Note that we will expand it to (batch_size * num_beams, sequence_length) later.
   // To avoid cloning input_ids, we use const_cast here since this function does not change its content.
-  input_ids_ = OrtValue::CreateTensor<int32_t>(allocator.GetInfo(), const_cast<int32_t*>(search_params_.input_ids.data()), input_ids_shape[0] * input_ids_shape[1], input_ids_shape, std::size(input_ids_shape));
+  input_ids_ = OrtValue::CreateTensor<int32_t>(memory_info_, const_cast<int32_t*>(search_params_.input_ids.data()), input_ids_shape[0] * input_ids_shape[1], input_ids_shape, std::size(input_ids_shape));
   position_ids_ = OrtValue::CreateTensor<int32_t>(allocator, input_ids_shape, std::size(input_ids_shape));
 
-  int64_t position_shape[] = {search_params_.batch_size * search_params_.num_beams, 1};
+  int64_t position_shape[] = {batch_beam_size, 1};
   next_positions_ = Allocate<int32_t>(allocator, position_shape[0], next_positions_buffer_);
   memset(next_positions_.data(), 0, next_positions_.size_bytes());
-  next_positions_tensor_ = OrtValue::CreateTensor<int32_t>(allocator.GetInfo(), next_positions_.data(), next_positions_.size(), position_shape, std::size(position_shape));
+  next_positions_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, next_positions_.data(), next_positions_.size(), position_shape, std::size(position_shape));
 
-  attention_mask_ = OrtValue::CreateTensor<int32_t>(allocator, input_ids_shape, std::size(input_ids_shape));
+  next_input_ids_ = Allocate<int32_t>(allocator, position_shape[0], next_input_ids_buffer_);
+  next_input_ids_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, next_input_ids_.data(), next_input_ids_.size(), position_shape, std::size(position_shape));
+
+  attention_mask_ = Allocate<int32_t>(allocator, batch_beam_size * search_params_.max_length, attention_mask_buffer_);
+  pad_counts_ = Allocate<int32_t>(allocator, batch_beam_size, pad_counts_buffer_);
 
   // Set attention mask to be 0 for pad tokens, and 1 for all other tokens.
   // Set position id to be 0 for pad tokens, and accumulated sum of mask in a batch for other tokens
-  int32_t* mask_data = attention_mask_->GetTensorMutableData<int32_t>();
   int32_t* position_data = position_ids_->GetTensorMutableData<int32_t>();
   const int32_t* word_id = search_params_.input_ids.data();
-  int32_t* mask = mask_data;
   int32_t* position = position_data;
   for (int i = 0; i < search_params_.batch_size; i++) {
+    int32_t* mask = attention_mask_.data() + i * search_params_.sequence_length;
     int32_t abs_position = 0;
-    for (int j = 0; j < search_params_.sequence_length; j++, word_id++, mask++, position++) {
+    for (int j = 0; j < search_params_.sequence_length; j++, word_id++, position++) {
       if (*word_id == search_params_.pad_token_id) {
-        *mask = 0;
+        mask[j] = 0;
         *position = 0;
       } else {
-        *mask = 1;
+        mask[j] = 1;
         *position = abs_position;
         abs_position++;
       }
     }
 
-    for (int k = 0; k < search_params_.num_beams; k++) {
-      sequence_lengths[i * search_params_.num_beams + k] = abs_position;
+    for (int k = 0; k < search_params_.RowsPerPrompt(); k++) {
+      sequence_lengths[i * search_params_.RowsPerPrompt() + k] = abs_position;
+      pad_counts_[i * search_params_.RowsPerPrompt() + k] = search_params_.sequence_length - abs_position;
     }
   }
 
-  // Expand (batch_size, sequence_length) to (batch_size * num_beams, sequence_length)
-  if (search_params_.num_beams == 1) {
-    expanded_input_ids_ = std::move(input_ids_);
-    expanded_position_ids_ = std::move(position_ids_);
-    expanded_attention_mask_ = std::move(attention_mask_);
-  } else {
-    ExpandInputs<int32_t>(*input_ids_, search_params_.num_beams, allocator, expanded_input_ids_);
-    ExpandInputs<int32_t>(*position_ids_, search_params_.num_beams, allocator, expanded_position_ids_);
-    ExpandInputs<int32_t>(*attention_mask_, search_params_.num_beams, allocator, expanded_attention_mask_);
+  int64_t mask_shape[] = {batch_size, search_params_.sequence_length};
+  expanded_attention_mask_ = OrtValue::CreateTensor<int32_t>(memory_info_, attention_mask_.data(), batch_size * search_params_.sequence_length, mask_shape, std::size(mask_shape));
+
+  // The last prefill chunk's logits go straight into logits_, the init decoder runs it if the whole prompt is one chunk.
+  // A model with logits for every position fetches its 'last_logits' output when it has one, otherwise the last prompt
+  // token is run as a chunk of its own. Either way the prefill logits are (batch_size, 1, vocab_size) for any prompt.
+  {
+    bool init_decoder = model_->session_init_decoder_ && prefill_chunk_size_ == search_params_.sequence_length;
+    bool logits_uses_seq_len = init_decoder ? model_->init_logits_uses_seq_len_ : model_->logits_uses_seq_len_;
+    bool has_last_logits = init_decoder ? model_->init_has_last_logits_ : model_->has_last_logits_;
+    int last_chunk_length = (search_params_.sequence_length - 1) % prefill_chunk_size_ + 1;
+    prefill_last_logits_ = logits_uses_seq_len && has_last_logits;
+    prefill_split_last_token_ = logits_uses_seq_len && !has_last_logits && last_chunk_length > 1;
+  }
+
+  if (prefill_chunk_size_ < search_params_.sequence_length || prefill_split_last_token_) {
+    chunk_input_ids_ = Allocate<int32_t>(allocator, batch_size * prefill_chunk_size_, chunk_input_ids_buffer_);
+    chunk_position_ids_ = Allocate<int32_t>(allocator, batch_size * prefill_chunk_size_, chunk_position_ids_buffer_);
+    chunk_attention_mask_ = Allocate<int32_t>(allocator, batch_size * search_params_.sequence_length, chunk_attention_mask_buffer_);
   }
 
-  for (auto* input : {expanded_input_ids_.get(), expanded_position_ids_.get(), expanded_attention_mask_.get()})
+  for (auto* input : {input_ids_.get(), position_ids_.get(), expanded_attention_mask_.get()})
     inputs_.push_back(input);
   for (auto* name : {"input_ids", "position_ids", "attention_mask"})
     input_name_strings_.push_back(name);
@@ -106,7 +97,7 @@ Gpt_State::Gpt_State(Gpt_Model& model, std::span<int32_t> sequence_lengths, cons
   auto past_type = Ort::TypeToTensorType<ScoreType>::type;
 
   // Initialize empty past state
-  int64_t empty_past_shape[] = {2, search_params_.batch_size * search_params_.num_beams, model_->head_count_, 0, model_->hidden_size_};
+  int64_t empty_past_shape[] = {2, batch_size, model_->head_count_, 0, model_->hidden_size_};
   empty_past_ = OrtValue::CreateTensor(allocator, empty_past_shape, std::size(empty_past_shape), past_type);
   for (int i = 0; i < model_->layer_count_; i++)
     inputs_.push_back(empty_past_.get());
@@ -121,19 +112,27 @@ Gpt_State::Gpt_State(Gpt_Model& model, std::span<int32_t> sequence_lengths, cons
     input_name_strings_.push_back(string);
   }
 
-  // Allocate space for logits (only works if we know the shape)
+  // Allocate space for logits, only the last position is used. The prefill only fills the first batch_size rows (see
+  // BroadcastPrefill).
   {
-    int64_t logits_shape[] = {search_params_.batch_size * search_params_.num_beams, model_->logits_uses_seq_len_ ? input_ids_shape[1] : 1, model_->vocab_size_};
-    logits_ = OrtValue::CreateTensor(allocator, logits_shape, std::size(logits_shape), past_type);
-    outputs_.push_back(logits_.get());
+    int64_t logits_shape[] = {batch_size, 1, model_->vocab_size_};
+    logits_ = Allocate<ScoreType>(allocator, batch_beam_size * model_->vocab_size_, logits_buffer_);
+    logits_tensor_ = OrtValue::CreateTensor<ScoreType>(memory_info_, logits_.data(), batch_size * model_->vocab_size_, logits_shape, std::size(logits_shape));
+    outputs_.push_back(logits_tensor_.get());
   }
 
   {
-    int64_t present_shape[] = {2, search_params_.batch_size * search_params_.num_beams, model_->head_count_, input_ids_shape[1], model_->hidden_size_};
+    int64_t present_shape[] = {2, batch_size, model_->head_count_, input_ids_shape[1], model_->hidden_size_};
+    size_t present_count = present_shape[0] * present_shape[1] * present_shape[2] * present_shape[3] * present_shape[4];
+    size_t buffer_count = 2 * batch_beam_size * model_->head_count_ * search_params_.max_length * model_->hidden_size_;
     outputs_.reserve(model_->layer_count_);
+    past_buffers_.resize(model_->layer_count_);
+    present_buffers_.resize(model_->layer_count_);
 
     for (int i = 0; i < model_->layer_count_; ++i) {
-      presents_.push_back(OrtValue::CreateTensor(allocator, present_shape, std::size(present_shape), past_type));
+      Allocate<ScoreType>(allocator, buffer_count, past_buffers_[i]);
+      Allocate<ScoreType>(allocator, buffer_count, present_buffers_[i]);
+      presents_.push_back(OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape, std::size(present_shape)));
       outputs_.push_back(presents_.back().get());
 
       char string[32];
@@ -148,12 +147,162 @@ Gpt_State::Gpt_State(Gpt_Model& model, std::span<int32_t> sequence_lengths, cons
     output_names_.push_back(output_name.c_str());
 }
 
+void Gpt_State::UseIoBinding(std::span<ScoreType> scores) {
+  assert(prefill_position_ == 0);
+  io_binding_ = OrtIoBinding::Create(*model_->session_decoder_);
+  if (scores.empty())
+    return;
+
+  assert(scores.size() == logits_.size());
+  int64_t scores_shape[] = {search_params_.batch_size, 1, model_->vocab_size_};  // The prefill's, see BroadcastPrefill
+  logits_tensor_ = OrtValue::CreateTensor<ScoreType>(memory_info_, scores.data(), search_params_.batch_size * model_->vocab_size_, scores_shape, std::size(scores_shape));
+  outputs_[0] = logits_tensor_.get();
+  logits_ = scores;
+  logits_buffer_.reset();
+}
+
+void Gpt_State::Bind(size_t first_input, size_t first_output) {
+  for (size_t i = first_input; i < inputs_.size(); i++)
+    io_binding_->BindInput(input_names_[i], *inputs_[i]);
+  for (size_t i = first_output; i < outputs_.size(); i++)
+    io_binding_->BindOutput(output_names_[i], *outputs_[i]);
+}
+
 std::span<ScoreType> Gpt_State::Run(int current_length, std::span<const int32_t> next_tokens, std::span<const int32_t> next_indices) {
-  if (first_run_)
+  Prepare(current_length, next_tokens, next_indices);
+  return RunPrepared();
+}
+
+void Gpt_State::Prepare(int current_length, std::span<const int32_t> next_tokens, std::span<const int32_t> next_indices) {
+  if (first_run_)  // The first run is the prompt, there are no next tokens yet
+    return;
+
+  auto* previous_input_ids = inputs_[0];
+  UpdateInputs(next_tokens, next_indices, current_length);
+  bool first_update = previous_input_ids != next_input_ids_tensor_.get();
+
+  // The input_ids, position_ids and logits tensors only change on the first update (or after the batch shrinks), the
+  // mask and past/present every time
+  if (io_binding_)
+    Bind(first_update ? 0 : 2, first_update ? 0 : 1);
+}
+
+std::span<ScoreType> Gpt_State::RunPrepared() {
+  if (first_run_) {
     first_run_ = false;
-  else
-    UpdateInputs(next_tokens, next_indices, current_length);
+    while (!IsPrefillDone())
+      RunPrefillChunk();
+    return logits_;
+  }
 
+  RunSession();
+  return logits_;
+}
+
+void Gpt_State::RunPrefillChunk() {
+  assert(!IsPrefillDone());
+
+  // The init decoder (if there is one) runs the first chunk, the decoder any chunks after it
+  bool init_decoder = model_->session_init_decoder_ && prefill_position_ == 0;
+  int end = std::min(prefill_position_ + prefill_chunk_size_, search_params_.sequence_length);
+  if (prefill_split_last_token_ && end == search_params_.sequence_length && end - prefill_position_ > 1)
+    end--;  // The last token is a chunk of its own
+  if (end - prefill_position_ < search_params_.sequence_length)
+    SetPrefillChunk(prefill_position_, end);
+  prefill_position_ = end;
+
+  // Only the last chunk's logits are used, the earlier chunks don't fetch them
+  size_t first_output = IsPrefillDone() ? 0 : 1;
+  if (IsPrefillDone() && prefill_last_logits_)
+    output_names_[0] = "last_logits";
+
+  if (io_binding_ && !init_decoder && !model_->session_prefill_)
+    Bind(0, first_output);
+  RunSession(first_output, init_decoder, true);
+
+  if (!IsPrefillDone())
+    return;
+
+  // The decode steps fetch 'logits' again, they rebind every output on the first step
+  output_names_[0] = output_name_strings_[0].c_str();
+  if (io_binding_ && prefill_last_logits_)
+    io_binding_->ClearBoundOutputs();
+
+  if (search_params_.RowsPerPrompt() > 1)
+    BroadcastPrefill();
+}
+
+// Copy the prefill's mask, presents and logits of each batch row to every beam of the row. Returned sequences get their
+// copy of the prompt's prefill the same way.
+void Gpt_State::BroadcastPrefill() {
+  int64_t batch_size = search_params_.batch_size;
+  int64_t batch_beam_size = search_params_.BatchBeamSize();
+  int num_beams = search_params_.RowsPerPrompt();
+  int64_t sequence_length = search_params_.sequence_length;
+
+  BroadcastRows(attention_mask_.data(), batch_size, num_beams, sequence_length);
+
+  // A present of shape (2, batch_size, ...) is two sets of rows, the keys then the values. The values are moved up to
+  // where they go in (2, batch_beam_size, ...) before either is broadcast.
+  int64_t present_shape[] = {2, batch_beam_size, model_->head_count_, sequence_length, model_->hidden_size_};
+  size_t block_size = static_cast<size_t>(model_->head_count_) * sequence_length * model_->hidden_size_;
+  for (size_t i = 0; i < model_->layer_count_; i++) {
+    ScoreType* present = present_buffers_[i].get();
+    ScoreType* values = present + batch_beam_size * block_size;
+    memmove(values, present + batch_size * block_size, sizeof(ScoreType) * batch_size * block_size);
+    BroadcastRows(values, batch_size, num_beams, block_size);
+    BroadcastRows(present, batch_size, num_beams, block_size);
+
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present, 2 * batch_beam_size * block_size, present_shape, std::size(present_shape));
+    outputs_[i + 1] = presents_[i].get();
+  }
+
+  BroadcastRows(logits_.data(), batch_size, num_beams, model_->vocab_size_);
+  int64_t logits_shape[] = {batch_beam_size, 1, model_->vocab_size_};
+  logits_tensor_ = OrtValue::CreateTensor<ScoreType>(memory_info_, logits_.data(), logits_.size(), logits_shape, std::size(logits_shape));
+  outputs_[0] = logits_tensor_.get();
+}
+
+// Point the inputs at the prompt columns [start, end), the past being the previous chunk's present
+void Gpt_State::SetPrefillChunk(int start, int end) {
+  int64_t batch_size = search_params_.batch_size;  // The prefill runs once per batch row
+  int sequence_length = search_params_.sequence_length;
+  int64_t chunk_length = end - start;
+
+  const int32_t* input_ids = input_ids_->GetTensorData<int32_t>();
+  const int32_t* position_ids = position_ids_->GetTensorData<int32_t>();
+  for (int i = 0; i < batch_size; i++) {
+    memcpy(chunk_input_ids_.data() + i * chunk_length, input_ids + i * sequence_length + start, sizeof(int32_t) * chunk_length);
+    memcpy(chunk_position_ids_.data() + i * chunk_length, position_ids + i * sequence_length + start, sizeof(int32_t) * chunk_length);
+    memcpy(chunk_attention_mask_.data() + i * end, attention_mask_.data() + i * sequence_length, sizeof(int32_t) * end);
+  }
+
+  int64_t chunk_shape[] = {batch_size, chunk_length};
+  chunk_input_ids_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, chunk_input_ids_.data(), batch_size * chunk_length, chunk_shape, std::size(chunk_shape));
+  chunk_position_ids_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, chunk_position_ids_.data(), batch_size * chunk_length, chunk_shape, std::size(chunk_shape));
+  int64_t mask_shape[] = {batch_size, end};
+  chunk_attention_mask_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, chunk_attention_mask_.data(), batch_size * end, mask_shape, std::size(mask_shape));
+  inputs_[0] = chunk_input_ids_tensor_.get();
+  inputs_[1] = chunk_position_ids_tensor_.get();
+  inputs_[2] = chunk_attention_mask_tensor_.get();
+
+  int64_t present_shape[] = {2, batch_size, model_->head_count_, end, model_->hidden_size_};
+  size_t present_count = 2 * static_cast<size_t>(batch_size) * model_->head_count_ * end * model_->hidden_size_;
+  for (size_t i = 0; i < model_->layer_count_; i++) {
+    if (start > 0) {
+      std::swap(past_buffers_[i], present_buffers_[i]);
+      pasts_[i] = std::move(presents_[i]);
+      inputs_[i + 3] = pasts_[i].get();
+    }
+
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape, std::size(present_shape));
+    outputs_[i + 1] = presents_[i].get();
+  }
+}
+
+// The init decoder is run once, so never through the io binding (which is for the decoder). Neither is the model's
+// prefill session, which runs the prefill if there is one.
+void Gpt_State::RunSession(size_t first_output, bool init_decoder, bool prefill) {
 #if 0
     printf("**Inputs:\r\n");
     DumpTensors(inputs_.data(), input_names_.data(), input_names_.size(), true);
@@ -162,65 +311,190 @@ std::span<ScoreType> Gpt_State::Run(int current_length, std::span<const int32_t>
 #endif
 
   try {
-    model_->session_decoder_->Run(nullptr, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data(), outputs_.data(), output_names_.size());
+    if (init_decoder)
+      model_->session_init_decoder_->Run(nullptr, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data() + first_output, outputs_.data() + first_output, output_names_.size() - first_output);
+    else if (prefill && model_->session_prefill_)
+      model_->session_prefill_->Run(nullptr, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data() + first_output, outputs_.data() + first_output, output_names_.size() - first_output);
+    else if (io_binding_)
+      model_->session_decoder_->Run(nullptr, *io_binding_);
+    else
+      model_->session_decoder_->Run(nullptr, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data() + first_output, outputs_.data() + first_output, output_names_.size() - first_output);
   } catch (const Ort::Exception& e) {
     std::cout << e.what() << std::endl;
   }
+}
+
+void Gpt_State::CompactRows(std::span<const int32_t> kept_rows) {
+  assert(search_params_.num_beams == 1 && !first_run_);
+  auto present_shape = presents_[0]->GetTensorTypeAndShapeInfo()->GetShape();
+  int64_t batch_size = present_shape[1];
+  int64_t kept_count = static_cast<int64_t>(kept_rows.size());
+  if (kept_count == batch_size || kept_count == 0)
+    return;
+
+  // Rows only move to earlier rows, so moving them from first to last never overwrites a row that hasn't moved yet.
+  // The mask rows are packed at the past length, the same as the past state.
+  int64_t past_length = present_shape[3];
+  for (int64_t i = 0; i < kept_count; i++) {
+    memmove(attention_mask_.data() + i * past_length, attention_mask_.data() + kept_rows[i] * past_length, sizeof(int32_t) * past_length);
+    pad_counts_[i] = pad_counts_[kept_rows[i]];
+  }
+
+  // The present state of shape (2, batch_size, head_count, past_length, hidden_size) becomes the past on the next run
+  present_shape[1] = kept_count;
+  size_t block_size = model_->head_count_ * past_length * model_->hidden_size_;
+  for (size_t layer = 0; layer < model_->layer_count_; layer++) {
+    ScoreType* present = present_buffers_[layer].get();
+    for (int64_t kv = 0; kv < 2; kv++) {
+      for (int64_t i = 0; i < kept_count; i++)
+        memmove(present + (kv * kept_count + i) * block_size, present + (kv * batch_size + kept_rows[i]) * block_size, sizeof(ScoreType) * block_size);
+    }
+    presents_[layer] = OrtValue::CreateTensor<ScoreType>(memory_info_, present, 2 * kept_count * block_size, present_shape.data(), present_shape.size());
+    outputs_[layer + 1] = presents_[layer].get();
+  }
+
+  ResizeBatch(kept_count);
+}
+
+// Point the single token input and logits tensors at the first 'batch_size' rows of their buffers
+void Gpt_State::ResizeBatch(int64_t batch_size) {
+  int64_t next_shape[] = {batch_size, 1};
+  next_input_ids_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, next_input_ids_.data(), batch_size, next_shape, std::size(next_shape));
+  next_positions_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, next_positions_.data(), batch_size, next_shape, std::size(next_shape));
+
+  int64_t logits_shape[] = {batch_size, 1, model_->vocab_size_};
+  logits_ = std::span<ScoreType>(logits_.data(), batch_size * model_->vocab_size_);
+  logits_tensor_ = OrtValue::CreateTensor<ScoreType>(memory_info_, logits_.data(), logits_.size(), logits_shape, std::size(logits_shape));
+  outputs_[0] = logits_tensor_.get();
+}
+
+std::span<ScoreType> Gpt_State::RunTokens(std::span<const int32_t> tokens, int token_count) {
+  assert(search_params_.num_beams == 1 && !first_run_ && model_->logits_uses_seq_len_);
+  auto present_shape = presents_[0]->GetTensorTypeAndShapeInfo()->GetShape();
+  int64_t batch_size = present_shape[1];
+  int64_t past_length = present_shape[3];
+  int64_t length = past_length + token_count;
+  size_t count = batch_size * token_count;
+  assert(tokens.size() == count && length <= search_params_.max_length);
+
+  if (tokens_input_ids_.size() < count) {
+    tokens_input_ids_ = Allocate<int32_t>(allocator_, count, tokens_input_ids_buffer_);
+    tokens_position_ids_ = Allocate<int32_t>(allocator_, count, tokens_position_ids_buffer_);
+    tokens_logits_ = Allocate<ScoreType>(allocator_, count * model_->vocab_size_, tokens_logits_buffer_);
+  }
+
+  // Positions follow on from the past, the same as a single token's in UpdateInputs
+  for (int64_t i = 0; i < batch_size; i++) {
+    for (int j = 0; j < token_count; j++) {
+      tokens_input_ids_[i * token_count + j] = tokens[i * token_count + j];
+      tokens_position_ids_[i * token_count + j] = static_cast<int32_t>(past_length + j - pad_counts_[i]);
+    }
+  }
+
+  int64_t tokens_shape[] = {batch_size, token_count};
+  tokens_input_ids_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, tokens_input_ids_.data(), count, tokens_shape, std::size(tokens_shape));
+  tokens_position_ids_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, tokens_position_ids_.data(), count, tokens_shape, std::size(tokens_shape));
+  inputs_[0] = tokens_input_ids_tensor_.get();
+  inputs_[1] = tokens_position_ids_tensor_.get();
+
+  // Each mask row grows by token_count
+  int32_t* mask_data = attention_mask_.data();
+  GrowMaskRows(mask_data, batch_size, past_length, token_count);
+  int64_t mask_dims[] = {batch_size, length};
+  expanded_attention_mask_ = OrtValue::CreateTensor<int32_t>(memory_info_, mask_data, batch_size * length, mask_dims, std::size(mask_dims));
+  inputs_[2] = expanded_attention_mask_.get();
+
+  int64_t logits_shape[] = {batch_size, token_count, model_->vocab_size_};
+  tokens_logits_tensor_ = OrtValue::CreateTensor<ScoreType>(memory_info_, tokens_logits_.data(), count * model_->vocab_size_, logits_shape, std::size(logits_shape));
+  outputs_[0] = tokens_logits_tensor_.get();
+
+  present_shape[3] = length;
+  size_t present_count = 2 * static_cast<size_t>(batch_size) * model_->head_count_ * length * model_->hidden_size_;
+  for (size_t i = 0; i < model_->layer_count_; i++) {
+    std::swap(past_buffers_[i], present_buffers_[i]);
+    pasts_[i] = std::move(presents_[i]);
+    inputs_[i + 3] = pasts_[i].get();
+
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape.data(), present_shape.size());
+    outputs_[i + 1] = presents_[i].get();
+  }
 
-  auto type_shape = logits_->GetTensorTypeAndShapeInfo();
-  auto shape = type_shape->GetShape();
-  assert(type_shape->GetShape().size() == 3);
+  if (io_binding_)
+    Bind(0, 0);
+  RunSession();
 
-  return {logits_->GetTensorMutableData<ScoreType>(), type_shape->GetElementCount()};
+  // The next Run is back to one token, so it rebinds everything (see Prepare)
+  outputs_[0] = logits_tensor_.get();
+  return tokens_logits_.subspan(0, count * model_->vocab_size_);
+}
+
+void Gpt_State::Truncate(int length) {
+  assert(!first_run_);
+  auto present_shape = presents_[0]->GetTensorTypeAndShapeInfo()->GetShape();
+  int64_t batch_beam_size = present_shape[1];
+  int64_t past_length = present_shape[3];
+  assert(length <= past_length);
+  if (length == past_length)
+    return;
+
+  // The mask rows and the (2, batch_beam_size, head_count) blocks of each present are repacked at the shorter length
+  TruncateRows(attention_mask_.data(), batch_beam_size, past_length, length);
+
+  present_shape[3] = length;
+  int64_t block_count = 2 * batch_beam_size * model_->head_count_;
+  size_t hidden_size = model_->hidden_size_;
+  for (size_t layer = 0; layer < model_->layer_count_; layer++) {
+    ScoreType* present = present_buffers_[layer].get();
+    TruncateRows(present, block_count, past_length * hidden_size, length * hidden_size);
+    presents_[layer] = OrtValue::CreateTensor<ScoreType>(memory_info_, present, block_count * length * hidden_size, present_shape.data(), present_shape.size());
+    outputs_[layer + 1] = presents_[layer].get();
+  }
 }
 
 void Gpt_State::UpdateInputs(std::span<const int32_t> next_tokens, std::span<const int32_t> beam_indices, int current_length) {
   assert(search_params_.num_beams == 1 || !beam_indices.empty());  // We require beam_indices if we're a beam search
-  auto& allocator = Ort::Allocator::GetWithDefaultOptions();
-
-  // The following updates inputs for subgraph
 
-  // Update input_ids with next tokens.
+  // The following updates inputs for subgraph, every buffer was allocated up front so none is allocated here. The mask
+  // and past/present tensors are still new views every step as their shapes grow, ORT allocates those small OrtValues.
   int batch_beam_size = static_cast<int>(next_tokens.size());
-  int64_t dims[] = {batch_beam_size, 1};
-  std::unique_ptr<OrtValue> input_ids = OrtValue::CreateTensor<int32_t>(allocator, dims, std::size(dims));
-  int32_t* input_ids_data = input_ids->GetTensorMutableData<int32_t>();
-  for (int i = 0; i < batch_beam_size; i++) {
-    input_ids_data[i] = next_tokens[i];
+
+  // Pruned beams shrink the batch (see BeamSearch::CompactBeams), the beam indices are then rows of the previous batch.
+  // The mask rows are picked the same as the past state.
+  int previous_batch_size = static_cast<int>(presents_[0]->GetTensorTypeAndShapeInfo()->GetShape()[1]);
+  if (batch_beam_size != previous_batch_size) {
+    assert(!beam_indices.empty() && batch_beam_size < previous_batch_size);
+    // Every beam of a batch entry has the same padding and so the same mask, and a beam's parent is a beam of its own
+    // batch entry. Batch entries only lose beams, so going from first to last a row is never overwritten before a later
+    // row of another batch entry reads it, and rows are picked in place.
+    int past_length = current_length - 1;
+    int32_t* mask_data = attention_mask_.data();
+    for (int i = 0; i < batch_beam_size; i++) {
+      memmove(mask_data + i * past_length, mask_data + beam_indices[i] * past_length, sizeof(int32_t) * past_length);
+      pad_counts_[i] = pad_counts_[beam_indices[i]];
+    }
+    ResizeBatch(batch_beam_size);
   }
-  expanded_input_ids_ = std::move(input_ids);
-  inputs_[0] = expanded_input_ids_.get();
 
-  // Update position IDs
+  // Update input_ids with next tokens.
+  copy(next_tokens, next_input_ids_);
+  inputs_[0] = next_input_ids_tensor_.get();
+
+  // Update position IDs, the position of each row's new token is its past length less the padding in its prompt
   inputs_[1] = next_positions_tensor_.get();
   {
     int32_t* position_data = next_positions_.data();
     for (int i = 0; i < batch_beam_size; i++) {
-      position_data[i] = current_length - 1;
+      position_data[i] = current_length - 1 - pad_counts_[i];
     }
   }
 
-  // Update attention mask
-  const int32_t* old_mask_data = expanded_attention_mask_->GetTensorMutableData<int32_t>();
+  // Update attention mask, each row grows by one
+  int32_t* mask_data = attention_mask_.data();
+  GrowMaskRows(mask_data, batch_beam_size, current_length - 1, 1);
   int64_t mask_dims[] = {batch_beam_size, current_length};
-  auto attention_mask = OrtValue::CreateTensor<int32_t>(allocator, mask_dims, std::size(mask_dims));
-  int32_t* mask_data = attention_mask->GetTensorMutableData<int32_t>();
-  for (int i = 0; i < batch_beam_size; i++) {
-    for (int j = 0; j < current_length - 1; j++) {
-      mask_data[i * current_length + j] = old_mask_data[i * (current_length - 1) + j];
-    }
-    mask_data[i * current_length + current_length - 1] = 1;
-  }
-  expanded_attention_mask_ = std::move(attention_mask);
+  expanded_attention_mask_ = OrtValue::CreateTensor<int32_t>(memory_info_, mask_data, batch_beam_size * current_length, mask_dims, std::size(mask_dims));
   inputs_[2] = expanded_attention_mask_.get();
 
-  // Update logits
-  if (model_->logits_uses_seq_len_) {
-    int64_t logits_shape[] = {search_params_.batch_size * search_params_.num_beams, 1, model_->vocab_size_};
-    logits_ = OrtValue::CreateTensor(allocator, logits_shape, std::size(logits_shape), Ort::TypeToTensorType<ScoreType>::type);
-    outputs_[0] = logits_.get();
-  }
-
 #if 0
   if (past_present_share_buffer) {
     int32_t* past_seq_len_data = const_cast<int32_t*>(next_inputs.back().Get<Tensor>().Data<int32_t>());
@@ -231,44 +505,42 @@ void Gpt_State::UpdateInputs(std::span<const int32_t> next_tokens, std::span<con
 
   // feed present_* output to past_* inputs one by one
   int64_t present_shape[] = {2, batch_beam_size, model_->head_count_, current_length, model_->hidden_size_};
+  size_t present_count = 2 * static_cast<size_t>(batch_beam_size) * model_->head_count_ * current_length * model_->hidden_size_;
 
   if (beam_indices.empty()) {  // Update past state
     for (size_t i = 0; i < model_->layer_count_; i++) {
+      std::swap(past_buffers_[i], present_buffers_[i]);
       pasts_[i] = std::move(presents_[i]);
       inputs_[i + 3] = pasts_[i].get();
 
-      presents_[i] = OrtValue::CreateTensor<float>(allocator, present_shape, std::size(present_shape));
+      presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape, std::size(present_shape));
       outputs_[i + 1] = presents_[i].get();
     }
   } else {
     for (size_t i = 0; i < model_->layer_count_; i++) {
-      PickPastState(allocator, i, beam_indices);
+      PickPastState(i, beam_indices, current_length - 1);
 
-      presents_[i] = OrtValue::CreateTensor<float>(allocator, present_shape, std::size(present_shape));
+      presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape, std::size(present_shape));
       outputs_[i + 1] = presents_[i].get();
     }
   }
 }
 
 // Copy present state to past state
-void Gpt_State::PickPastState(OrtAllocator& allocator, size_t index, std::span<const int32_t> beam_indices) {
-  const OrtValue& present = *presents_[index];
-
-  // shape is (2, batch_beam_size, 12, past_seq_len, 64)
-  auto past_shape_info = present.GetTensorTypeAndShapeInfo();
-  auto past_shape = past_shape_info->GetShape();
+void Gpt_State::PickPastState(size_t index, std::span<const int32_t> beam_indices, int past_length) {
+  // shape is (2, batch_beam_size, 12, past_seq_len, 64). The present can have more rows if beams were pruned.
+  int64_t past_shape[] = {2, static_cast<int64_t>(beam_indices.size()), model_->head_count_, past_length, model_->hidden_size_};
   auto block_size_per_beam = past_shape[2] * past_shape[3] * past_shape[4];
   auto past_key_size = past_shape[1] * past_shape[2] * past_shape[3] * past_shape[4];
+  auto present_key_size = presents_[index]->GetTensorTypeAndShapeInfo()->GetShape()[1] * block_size_per_beam;
+  size_t element_count = 2 * past_key_size;
 
-  // Create a tensor with same shape.
-  auto past = OrtValue::CreateTensor<ScoreType>(allocator, past_shape.data(), past_shape.size());
-
-  auto past_span = std::span<ScoreType>(past->GetTensorMutableData<ScoreType>(), past_shape_info->GetElementCount());
-  auto present_span = std::span<const ScoreType>(present.GetTensorData<ScoreType>(), past_shape_info->GetElementCount());
+  auto past_span = std::span<ScoreType>(past_buffers_[index].get(), element_count);
+  auto present_span = std::span<const ScoreType>(present_buffers_[index].get(), 2 * present_key_size);
   for (size_t j = 0; j < beam_indices.size(); j++) {
     int32_t beam_index = beam_indices[j];
     std::span<const ScoreType> present_key = present_span.subspan(beam_index * block_size_per_beam, block_size_per_beam);
-    std::span<const ScoreType> present_value = present_span.subspan(past_key_size + beam_index * block_size_per_beam, block_size_per_beam);
+    std::span<const ScoreType> present_value = present_span.subspan(present_key_size + beam_index * block_size_per_beam, block_size_per_beam);
 
     std::span<ScoreType> past_key = past_span.subspan(j * block_size_per_beam, block_size_per_beam);
     std::span<ScoreType> past_value = past_span.subspan(past_key_size + j * block_size_per_beam, block_size_per_beam);
@@ -276,7 +548,7 @@ void Gpt_State::PickPastState(OrtAllocator& allocator, size_t index, std::span<c
     copy(present_value, past_value);
   }
 
-  pasts_[index] = std::move(past);
+  pasts_[index] = OrtValue::CreateTensor<ScoreType>(memory_info_, past_span.data(), element_count, past_shape, std::size(past_shape));
   inputs_[index + 3] = pasts_[index].get();
 }
 
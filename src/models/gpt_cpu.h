@@ -5,28 +5,90 @@ namespace Generators {
 
 struct Gpt_State {
 
-  Gpt_State(Gpt_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& params);
+  // If prefill_chunk_size is non zero, the prompt is run in chunks of at most that many tokens with the past state carried
+  // between them. This bounds the prefill attention and activation memory to the chunk size. Only the last position's
+  // prefill logits are ever fetched, whatever the chunk size.
+  Gpt_State(const Gpt_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& params, int prefill_chunk_size = 0);
 
   std::span<ScoreType> Run(int current_length, std::span<const int32_t> next_tokens, std::span<const int32_t> next_indices = {});
 
+  // Run split in two: Prepare updates the inputs for the next tokens and RunPrepared runs the model. This lets one state's
+  // input update overlap another state's model run (see RunPipelined).
+  void Prepare(int current_length, std::span<const int32_t> next_tokens, std::span<const int32_t> next_indices = {});
+  std::span<ScoreType> RunPrepared();
+
+  // Drop rows from the batch, keeping the given rows (in increasing order) of the current batch. Greedy search only, the
+  // rows come from GreedySearch::CompactFinishedRows.
+  void CompactRows(std::span<const int32_t> kept_rows);
+
+  // Run 'token_count' tokens per row at once, 'tokens' being of shape (batch_size, token_count), after the past state of an
+  // earlier Run. Returns the logits of every one of them, shape (batch_size, token_count, vocab_size). No beams, and the
+  // model needs logits for every position. For appending a chat turn without rerunning the conversation, or checking a
+  // run of speculated tokens (see Gpt_Speculative).
+  std::span<ScoreType> RunTokens(std::span<const int32_t> tokens, int token_count);
+
+  // Drop the end of the past state so 'length' positions are left, such as the rejected tokens after a RunTokens. The
+  // next Run's current_length is then length + 1.
+  void Truncate(int length);
+  int GetPastLength() const { return static_cast<int>(presents_[0]->GetTensorTypeAndShapeInfo()->GetShape()[3]); }
+
+  // Present state of a layer from the last run, shape (2, batch_size * num_beams, head_count, length, hidden_size)
+  const OrtValue& GetPresent(int layer) const { return *presents_[layer]; }
+
+  // The first Run prefills any prompt chunks not yet run, a scheduler can call this to interleave them with other work
+  void RunPrefillChunk();
+  bool IsPrefillDone() const { return prefill_position_ == search_params_.sequence_length; }
+
+  // Run through an OrtIoBinding that only rebinds the tensors that change between runs. Must be called before the first Run.
+  // If 'scores' is given (the search's next_token_scores_), the logits are written directly into it.
+  void UseIoBinding(std::span<ScoreType> scores = {});
+
  private:
   void UpdateInputs(std::span<const int32_t> next_tokens, std::span<const int32_t> beam_indices, int current_length);
-  void PickPastState(OrtAllocator& allocator, size_t index, std::span<const int32_t> beam_indices);
+  void Bind(size_t first_input, size_t first_output);
+  void RunSession(size_t first_output = 0, bool init_decoder = false, bool prefill = false);
+  void SetPrefillChunk(int start, int end);
+  void BroadcastPrefill();
+  void PickPastState(size_t index, std::span<const int32_t> beam_indices, int past_length);
+  void ResizeBatch(int64_t batch_size);
 
   SearchParams search_params_;
   bool first_run_{true};
 
+  // Model
+  const Gpt_Model* model_;
+  OrtAllocator& allocator_;
+  const OrtMemoryInfo& memory_info_;
+
   std::span<int32_t> next_positions_;  // shape (batch_size, num_beams). Next position value for position_ids.
   Ort::IAllocatorUniquePtr<int32_t> next_positions_buffer_;
   std::unique_ptr<OrtValue> next_positions_tensor_; // Tensor of the 'next_position_' buffer
 
-  // Model
-  Gpt_Model* model_;
+  // Padding tokens in each row's prompt. The prompt's position ids skip them, so a row's next position is its past length
+  // less its padding.
+  std::span<int32_t> pad_counts_;  // shape (batch_size * num_beams)
+  Ort::IAllocatorUniquePtr<int32_t> pad_counts_buffer_;
+
+  std::span<int32_t> next_input_ids_;  // shape (batch_size * num_beams, 1). Input ids for every run after the first.
+  Ort::IAllocatorUniquePtr<int32_t> next_input_ids_buffer_;
+  std::unique_ptr<OrtValue> next_input_ids_tensor_;
+
+  // Allocated at max_length capacity, the rows are kept packed for the current length and grown in place every run
+  std::span<int32_t> attention_mask_;  // shape (batch_size * num_beams, current_length)
+  Ort::IAllocatorUniquePtr<int32_t> attention_mask_buffer_;
+
+  int prefill_chunk_size_;
+  int prefill_position_{};  // How much of the prompt has been run
+
+  // Only allocated if the prompt is longer than the prefill chunk size, the current chunk's slice of the prompt inputs
+  std::span<int32_t> chunk_input_ids_, chunk_position_ids_;  // shape (batch_size * num_beams, chunk_length)
+  std::span<int32_t> chunk_attention_mask_;                   // shape (batch_size * num_beams, chunk_end)
+  Ort::IAllocatorUniquePtr<int32_t> chunk_input_ids_buffer_, chunk_position_ids_buffer_, chunk_attention_mask_buffer_;
+  std::unique_ptr<OrtValue> chunk_input_ids_tensor_, chunk_position_ids_tensor_, chunk_attention_mask_tensor_;
 
   // Inputs
-  std::unique_ptr<OrtValue> input_ids_, expanded_input_ids_;
-  std::unique_ptr<OrtValue> position_ids_, expanded_position_ids_;
-  std::unique_ptr<OrtValue> attention_mask_, expanded_attention_mask_;
+  std::unique_ptr<OrtValue> input_ids_, position_ids_;  // shape (batch_size, sequence_length), the prefill runs once per batch row
+  std::unique_ptr<OrtValue> expanded_attention_mask_;
   std::unique_ptr<OrtValue> empty_past_;
   std::vector<std::unique_ptr<OrtValue>> pasts_;
 
@@ -35,11 +97,31 @@ struct Gpt_State {
   std::vector<OrtValue*> inputs_;
 
   // Outputs
-  std::unique_ptr<OrtValue> logits_;
+  std::span<ScoreType> logits_;  // shape (batch_size * num_beams, 1, vocab_size)
+  Ort::IAllocatorUniquePtr<ScoreType> logits_buffer_;
+  std::unique_ptr<OrtValue> logits_tensor_;
+
+  // How the last prefill chunk's logits fit in logits_ with a model that has logits for every position. Either through the
+  // model's 'last_logits' output, or by running the last prompt token as a chunk of its own.
+  bool prefill_last_logits_{};
+  bool prefill_split_last_token_{};
   std::vector<std::unique_ptr<OrtValue>> presents_;
   std::vector<std::string> output_name_strings_;
   std::vector<const char*> output_names_;
   std::vector<OrtValue*> outputs_;
+
+  std::unique_ptr<OrtIoBinding> io_binding_;
+
+  // Only allocated by RunTokens, grown as needed
+  std::span<int32_t> tokens_input_ids_, tokens_position_ids_;  // shape (batch_size, token_count)
+  Ort::IAllocatorUniquePtr<int32_t> tokens_input_ids_buffer_, tokens_position_ids_buffer_;
+  std::span<ScoreType> tokens_logits_;  // shape (batch_size, token_count, vocab_size)
+  Ort::IAllocatorUniquePtr<ScoreType> tokens_logits_buffer_;
+  std::unique_ptr<OrtValue> tokens_input_ids_tensor_, tokens_position_ids_tensor_, tokens_logits_tensor_;
+
+  // Two buffers per layer of shape (2, batch_size * num_beams, head_count, max_length, hidden_size). The pasts_ and
+  // presents_ tensors are views of the current length into them, after every run the present becomes the past.
+  std::vector<Ort::IAllocatorUniquePtr<ScoreType>> past_buffers_, present_buffers_;
 };
 
-}
\ No newline at end of file
+}
@@ -37,14 +37,14 @@ void LaunchGpt_InitAttentionMask(int32_t * mask_data, int32_t * position_data, i
     Gpt_InitAttentionMask<<<1, 1, 0, stream>>>(mask_data, position_data, sequence_lengths, input_ids, batch_size, num_beams, sequence_length, pad_token_id);
 }
 
-__global__ void Gpt_UpdatePositionIds(int32_t* positions, int batch_beam_size, int current_length) {
+__global__ void Gpt_UpdatePositionIds(int32_t* positions, const int32_t* pad_counts, int batch_beam_size, int current_length) {
     for (int i = 0; i < batch_beam_size; i++) {
-      positions[i] = current_length - 1;
+      positions[i] = current_length - 1 - pad_counts[i];
       }
 }
 
-void LaunchGpt_UpdatePositionIds(int32_t* positions, int batch_beam_size, int current_length, cudaStream_t stream) {
-      Gpt_UpdatePositionIds<<<1, 1, 0, stream>>>(positions, batch_beam_size, current_length);
+void LaunchGpt_UpdatePositionIds(int32_t* positions, const int32_t* pad_counts, int batch_beam_size, int current_length, cudaStream_t stream) {
+      Gpt_UpdatePositionIds<<<1, 1, 0, stream>>>(positions, pad_counts, batch_beam_size, current_length);
 }
 
 __global__ void Gpt_UpdateMask(int32_t* mask_data, const int32_t* old_mask_data, int batch_beam_size, int current_length) {
@@ -94,14 +94,14 @@ void LaunchGpt_InitAttentionMask(int64_t * mask_data, int64_t * position_data, i
   Gpt_InitAttentionMask<<<1, 1, 0, stream>>>(mask_data, position_data, sequence_lengths, input_ids, batch_size, num_beams, sequence_length, pad_token_id);
 }
 
-__global__ void Gpt_UpdatePositionIds(int64_t* positions, int batch_beam_size, int current_length) {
+__global__ void Gpt_UpdatePositionIds(int64_t* positions, const int32_t* pad_counts, int batch_beam_size, int current_length) {
   for (int i = 0; i < batch_beam_size; i++) {
-    positions[i] = current_length - 1;
+    positions[i] = current_length - 1 - pad_counts[i];
   }
 }
 
-void LaunchGpt_UpdatePositionIds(int64_t* positions, int batch_beam_size, int current_length, cudaStream_t stream) {
-  Gpt_UpdatePositionIds<<<1, 1, 0, stream>>>(positions, batch_beam_size, current_length);
+void LaunchGpt_UpdatePositionIds(int64_t* positions, const int32_t* pad_counts, int batch_beam_size, int current_length, cudaStream_t stream) {
+  Gpt_UpdatePositionIds<<<1, 1, 0, stream>>>(positions, pad_counts, batch_beam_size, current_length);
 }
 
 __global__ void Gpt_UpdateMask(int64_t* mask_data, const int64_t* old_mask_data, int batch_beam_size, int current_length) {
@@ -5,7 +5,7 @@ namespace Generators {
 
 struct Gpt_Cuda {
 
-  Gpt_Cuda(Gpt_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& search_params);
+  Gpt_Cuda(const Gpt_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& search_params);
 
   std::span<ScoreType> Run(int current_length, std::span<const int32_t> next_tokens, std::span<const int32_t> next_indices = {});
 
@@ -26,8 +26,11 @@ struct Gpt_Cuda {
   Ort::IAllocatorUniquePtr<int32_t> next_positions_buffer_;
   std::unique_ptr<OrtValue> next_positions_tensor_;  // Tensor of the 'next_position_' buffer
 
+  std::span<int32_t> pad_counts_;  // shape (batch_size, num_beams). Pad tokens in each row's prompt, on the device.
+  cuda_unique_ptr<int32_t> pad_counts_buffer_;
+
   // Sessions
-  Gpt_Model* model_;
+  const Gpt_Model* model_;
 
   // Inputs
   std::unique_ptr<OrtValue> input_ids_, expanded_input_ids_;
@@ -53,7 +56,7 @@ namespace cuda {
 
 void LaunchGpt_InitAttentionMask(int32_t* mask_data, int32_t* position_data, int32_t* sequence_lengths, const int32_t* input_ids,
                                  int batch_size, int num_beams, int sequence_length, int pad_token_id, cudaStream_t stream);
-void LaunchGpt_UpdatePositionIds(int32_t* positions, int batch_beam_size, int current_length, cudaStream_t stream);
+void LaunchGpt_UpdatePositionIds(int32_t* positions, const int32_t* pad_counts, int batch_beam_size, int current_length, cudaStream_t stream);
 void LaunchGpt_UpdateMask(int32_t* mask_data, const int32_t* old_mask_data, int batch_beam_size, int current_length, cudaStream_t stream);
 
 }
@@ -0,0 +1,371 @@
+#include "../generators.h"
+#include "../search.h"
+#include "gpt_cpu.h"
+#include "gpt_engine.h"
+#include "model_rows.h"
+#include <iostream>
+
+namespace Generators {
+
+Gpt_Request::Gpt_Request(const SearchParams& params)
+    : input_ids_(params.input_ids.data(), params.input_ids.data() + params.input_ids.size()),
+      params_{params} {
+  assert(params_.batch_size == 1 && params_.num_beams == 1);
+  params_.input_ids = input_ids_;  // The caller's input_ids only need to live until Add returns
+  search_ = std::make_unique<GreedySearch>(params_);
+}
+
+Gpt_Request::~Gpt_Request() = default;
+
+void Gpt_Request::TakeTokens(std::vector<int32_t>& tokens) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  tokens.insert(tokens.end(), output_.begin(), output_.end());
+  output_.clear();
+}
+
+bool Gpt_Request::TakeToken(std::optional<int32_t>& token) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  if (!output_.empty()) {
+    token = output_.front();
+    output_.pop_front();
+    return true;
+  }
+  token.reset();
+  return done_;
+}
+
+bool Gpt_Request::IsReady() {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return !output_.empty() || done_;
+}
+
+bool Gpt_Request::IsDone() {
+  std::lock_guard<std::mutex> lock{mutex_};
+  return done_;
+}
+
+void Gpt_Request::SelectNextToken(std::span<const ScoreType> logits) {
+  search_->SetLogits(logits);
+  search_->SelectTop();
+
+  std::lock_guard<std::mutex> lock{mutex_};
+  output_.push_back(search_->GetNextTokens()[0]);
+  done_ = search_->IsDone();
+}
+
+Gpt_Engine::Gpt_Engine(const Gpt_Model& model, int max_batch_size, int max_length, bool disaggregated_prefill)
+    : model_{model},
+      disaggregated_prefill_{disaggregated_prefill},
+      allocator_{*model.allocator_cpu_},
+      memory_info_{*allocator_.Info(&allocator_)},
+      max_batch_size_{max_batch_size},
+      max_length_{max_length} {
+  size_t kv_count = 2 * static_cast<size_t>(max_batch_size_) * model_.head_count_ * max_length_ * model_.hidden_size_;
+  for (int i = 0; i < 2; i++) {
+    masks_[i] = Allocate<int32_t>(allocator_, max_batch_size_ * max_length_, mask_buffers_[i]);
+    kv_buffers_[i].resize(model_.layer_count_);
+    for (auto& buffer : kv_buffers_[i])
+      Allocate<ScoreType>(allocator_, kv_count, buffer);
+  }
+
+  input_ids_ = Allocate<int32_t>(allocator_, max_batch_size_, input_ids_buffer_);
+  position_ids_ = Allocate<int32_t>(allocator_, max_batch_size_, position_ids_buffer_);
+  logits_ = Allocate<ScoreType>(allocator_, max_batch_size_ * model_.vocab_size_, logits_buffer_);
+
+  for (auto* name : {"input_ids", "position_ids", "attention_mask"})
+    input_name_strings_.push_back(name);
+  output_name_strings_.push_back("logits");
+  for (int i = 0; i < model_.layer_count_; ++i) {
+    char string[32];
+    snprintf(string, std::size(string), "past_%d", i);
+    input_name_strings_.push_back(string);
+    snprintf(string, std::size(string), "present_%d", i);
+    output_name_strings_.push_back(string);
+  }
+
+  for (auto& input_name : input_name_strings_)
+    input_names_.push_back(input_name.c_str());
+  for (auto& output_name : output_name_strings_)
+    output_names_.push_back(output_name.c_str());
+
+  pasts_.resize(model_.layer_count_);
+  presents_.resize(model_.layer_count_);
+  inputs_.resize(input_names_.size());
+  outputs_.resize(output_names_.size());
+
+  if (disaggregated_prefill_)
+    prefill_thread_ = std::thread(&Gpt_Engine::PrefillThread, this);
+}
+
+Gpt_Engine::~Gpt_Engine() {
+  if (prefill_thread_.joinable()) {
+    {
+      std::lock_guard<std::mutex> lock{mutex_};
+      stop_ = true;
+      prefill_condition_.notify_all();
+    }
+    prefill_thread_.join();
+  }
+}
+
+std::shared_ptr<Gpt_Request> Gpt_Engine::Add(const SearchParams& params) {
+  auto request = std::make_shared<Gpt_Request>(params);
+  Add(request);
+  return request;
+}
+
+void Gpt_Engine::Add(std::shared_ptr<Gpt_Request> request) {
+  assert(request->params_.max_length <= max_length_);
+  std::lock_guard<std::mutex> lock{mutex_};
+  waiting_.push_back(std::move(request));
+  prefill_condition_.notify_one();
+}
+
+size_t Gpt_Engine::GetRequestCount() const {
+  std::lock_guard<std::mutex> lock{mutex_};
+  size_t live_count = std::count_if(rows_.begin(), rows_.end(), [](auto& row) { return row != nullptr; });
+  return live_count + waiting_.size() + prefilling_ + prefilled_.size();
+}
+
+// The first token comes from the prefill
+Gpt_Engine::Prefill Gpt_Engine::RunPrefill(std::shared_ptr<Gpt_Request> request) {
+  auto& search = *request->search_;
+  auto state = std::make_unique<Gpt_State>(model_, search.sequence_lengths_, request->params_);
+  request->SelectNextToken(state->Run(search.GetSequenceLength(), search.GetNextTokens()));
+  return Prefill{std::move(request), std::move(state)};
+}
+
+void Gpt_Engine::PrefillThread() {
+  while (true) {
+    std::shared_ptr<Gpt_Request> request;
+    {
+      std::unique_lock<std::mutex> lock{mutex_};
+      // Only prefill into free rows, as every prefill holds on to its past state until it's merged
+      prefill_condition_.wait(lock, [this] {
+        return stop_ || (!waiting_.empty() && row_count_ + prefilling_ + prefilled_.size() < static_cast<size_t>(max_batch_size_));
+      });
+      if (stop_)
+        return;
+      request = std::move(waiting_.front());
+      waiting_.pop_front();
+      prefilling_++;
+    }
+
+    auto prefill = RunPrefill(std::move(request));
+
+    std::lock_guard<std::mutex> lock{mutex_};
+    prefilling_--;
+    if (!prefill.request->search_->IsDone())
+      prefilled_.push_back(std::move(prefill));
+    decode_condition_.notify_one();
+  }
+}
+
+bool Gpt_Engine::Step() {
+  // Requests that finished on the last step leave a hole in the batch
+  size_t live_count = 0;
+  for (auto& row : rows_) {
+    if (row && row->search_->IsDone())
+      row.reset();
+    live_count += row != nullptr;
+  }
+
+  std::vector<Prefill> prefills;
+  auto has_free_row = [&]() { return live_count + prefills.size() < static_cast<size_t>(max_batch_size_); };
+
+  if (disaggregated_prefill_) {
+    // Take the finished prefills, with an empty batch there is nothing to decode so wait for one
+    std::unique_lock<std::mutex> lock{mutex_};
+    row_count_ = live_count;
+    prefill_condition_.notify_one();
+    if (live_count == 0)
+      decode_condition_.wait(lock, [this] { return !prefilled_.empty() || (waiting_.empty() && prefilling_ == 0); });
+    while (!prefilled_.empty() && has_free_row()) {
+      prefills.push_back(std::move(prefilled_.front()));
+      prefilled_.pop_front();
+    }
+    row_count_ = live_count + prefills.size();
+    prefill_condition_.notify_one();
+  } else {
+    // Waiting requests are prefilled on their own into the free rows
+    std::unique_lock<std::mutex> lock{mutex_};
+    while (!waiting_.empty() && has_free_row()) {
+      auto request = std::move(waiting_.front());
+      waiting_.pop_front();
+      lock.unlock();
+      auto prefill = RunPrefill(std::move(request));
+      if (!prefill.request->search_->IsDone())
+        prefills.push_back(std::move(prefill));
+      lock.lock();
+    }
+  }
+
+  if (live_count != rows_.size() || !prefills.empty() || length_ >= max_length_)
+    Relayout(prefills);
+
+  if (rows_.empty()) {
+    std::lock_guard<std::mutex> lock{mutex_};
+    return !waiting_.empty();
+  }
+
+  RunDecode();
+  return true;
+}
+
+// Fill the holes left by finished requests with the prefilled ones. That's done in place and only writes the new rows, as
+// long as they fit in the holes and the batch's length. Otherwise the live rows and the prefilled ones are copied into
+// the free mask and past buffers as a new batch, which also drops the holes and the leading columns masked out in every
+// row. It's rebuilt too once over half of it would be holes, as the holes still take part in every decode step.
+void Gpt_Engine::Relayout(std::vector<Prefill>& prefills) {
+  int64_t head_count = model_.head_count_;
+  int64_t hidden_size = model_.hidden_size_;
+  int64_t old_row_count = static_cast<int64_t>(rows_.size());
+
+  // Copy a row's past state into row 'row' of 'kv_target', right aligned and zero padded to 'length'
+  auto copy_past = [&](std::vector<Ort::IAllocatorUniquePtr<ScoreType>>& kv_target, int64_t row_count, int64_t length, int64_t row,
+                       const ScoreType* source, int64_t source_row_count, int64_t source_row, int64_t source_length, int64_t source_start, size_t layer) {
+    int64_t row_length = source_length - source_start;
+    int64_t pad = length - row_length;
+    for (int64_t kv = 0; kv < 2; kv++) {
+      for (int64_t head = 0; head < head_count; head++) {
+        ScoreType* target = kv_target[layer].get() + ((kv * row_count + row) * head_count + head) * length * hidden_size;
+        const ScoreType* block = source + (((kv * source_row_count + source_row) * head_count + head) * source_length + source_start) * hidden_size;
+        memset(target, 0, sizeof(ScoreType) * pad * hidden_size);
+        memcpy(target + pad * hidden_size, block, sizeof(ScoreType) * row_length * hidden_size);
+      }
+    }
+  };
+
+  // Write a prefilled request's mask and past state into row 'row'
+  auto write_prefill = [&](int32_t* mask_target, std::vector<Ort::IAllocatorUniquePtr<ScoreType>>& kv_target, int64_t row_count, int64_t length, int64_t row, Prefill& prefill) {
+    auto& request = *prefill.request;
+    int sequence_length = request.params_.sequence_length;
+    int pad = static_cast<int>(length) - sequence_length;
+    memset(mask_target + row * length, 0, sizeof(int32_t) * pad);
+    for (int j = 0; j < sequence_length; j++)
+      mask_target[row * length + pad + j] = request.input_ids_[j] == request.params_.pad_token_id ? 0 : 1;
+    for (size_t layer = 0; layer < model_.layer_count_; layer++)
+      copy_past(kv_target, row_count, length, row, prefill.state->GetPresent(static_cast<int>(layer)).GetTensorData<ScoreType>(), 1, 0, sequence_length, 0, layer);
+  };
+
+  size_t hole_count = std::count(rows_.begin(), rows_.end(), nullptr);
+  int longest = 0;
+  for (auto& prefill : prefills)
+    longest = std::max(longest, prefill.request->params_.sequence_length);
+
+  if (prefills.size() <= hole_count && longest <= length_ && length_ < max_length_ && 2 * (hole_count - prefills.size()) <= rows_.size()) {
+    size_t row = 0;
+    for (auto& prefill : prefills) {
+      while (rows_[row])
+        row++;
+      write_prefill(masks_[mask_current_].data(), kv_buffers_[kv_current_], old_row_count, length_, row, prefill);
+      row_positions_[row] = prefill.request->search_->sequence_lengths_[0];
+      rows_[row] = std::move(prefill.request);
+    }
+    return;
+  }
+
+  std::vector<int32_t> kept_rows;
+  for (size_t i = 0; i < rows_.size(); i++) {
+    if (rows_[i])
+      kept_rows.push_back(static_cast<int32_t>(i));
+  }
+  int64_t row_count = static_cast<int64_t>(kept_rows.size() + prefills.size());
+
+  // Leading columns that are masked out in every kept row are dropped
+  int trim = length_;
+  for (size_t i = 0; i < kept_rows.size(); i++) {
+    int32_t* mask = masks_[mask_current_].data() + kept_rows[i] * length_;
+    trim = std::min(trim, static_cast<int>(std::find(mask, mask + length_, 1) - mask));
+  }
+
+  int length = std::max(kept_rows.empty() ? 0 : length_ - trim, longest);
+  assert(length < max_length_);
+
+  int32_t* mask_target = masks_[mask_current_ ^ 1].data();
+  auto& kv_target = kv_buffers_[kv_current_ ^ 1];
+
+  std::vector<std::shared_ptr<Gpt_Request>> rows;
+  std::vector<int32_t> row_positions;
+
+  for (size_t i = 0; i < kept_rows.size(); i++) {
+    int64_t row = static_cast<int64_t>(i);
+    int32_t source_row = kept_rows[i];
+    int pad = trim + length - length_;
+    memset(mask_target + row * length, 0, sizeof(int32_t) * pad);
+    memcpy(mask_target + row * length + pad, masks_[mask_current_].data() + source_row * length_ + trim, sizeof(int32_t) * (length_ - trim));
+    for (size_t layer = 0; layer < model_.layer_count_; layer++)
+      copy_past(kv_target, row_count, length, row, kv_buffers_[kv_current_][layer].get(), old_row_count, source_row, length_, trim, layer);
+
+    rows.push_back(std::move(rows_[source_row]));
+    row_positions.push_back(row_positions_[source_row]);
+  }
+
+  for (auto& prefill : prefills) {
+    write_prefill(mask_target, kv_target, row_count, length, static_cast<int64_t>(rows.size()), prefill);
+    row_positions.push_back(prefill.request->search_->sequence_lengths_[0]);
+    rows.push_back(std::move(prefill.request));
+  }
+
+  rows_ = std::move(rows);
+  row_positions_ = std::move(row_positions);
+  length_ = length;
+  mask_current_ ^= 1;
+  kv_current_ ^= 1;
+}
+
+void Gpt_Engine::RunDecode() {
+  int64_t row_count = static_cast<int64_t>(rows_.size());
+  int64_t length = length_ + 1;
+  assert(length <= max_length_);
+
+  // A hole runs any token, its logits are ignored
+  for (size_t i = 0; i < rows_.size(); i++) {
+    input_ids_[i] = rows_[i] ? rows_[i]->search_->GetNextTokens()[0] : 0;
+    position_ids_[i] = rows_[i] ? row_positions_[i]++ : 0;
+  }
+
+  // Each mask row grows by one
+  int32_t* mask_data = masks_[mask_current_].data();
+  GrowMaskRows(mask_data, row_count, length_, 1);
+
+  int64_t input_shape[] = {row_count, 1};
+  input_ids_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, input_ids_.data(), row_count, input_shape, std::size(input_shape));
+  position_ids_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, position_ids_.data(), row_count, input_shape, std::size(input_shape));
+  int64_t mask_shape[] = {row_count, length};
+  attention_mask_tensor_ = OrtValue::CreateTensor<int32_t>(memory_info_, mask_data, row_count * length, mask_shape, std::size(mask_shape));
+  inputs_[0] = input_ids_tensor_.get();
+  inputs_[1] = position_ids_tensor_.get();
+  inputs_[2] = attention_mask_tensor_.get();
+
+  int64_t logits_shape[] = {row_count, 1, model_.vocab_size_};
+  logits_tensor_ = OrtValue::CreateTensor<ScoreType>(memory_info_, logits_.data(), row_count * model_.vocab_size_, logits_shape, std::size(logits_shape));
+  outputs_[0] = logits_tensor_.get();
+
+  int64_t past_shape[] = {2, row_count, model_.head_count_, length_, model_.hidden_size_};
+  int64_t present_shape[] = {2, row_count, model_.head_count_, length, model_.hidden_size_};
+  size_t past_count = 2 * static_cast<size_t>(row_count) * model_.head_count_ * length_ * model_.hidden_size_;
+  size_t present_count = 2 * static_cast<size_t>(row_count) * model_.head_count_ * length * model_.hidden_size_;
+  for (size_t i = 0; i < model_.layer_count_; i++) {
+    pasts_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, kv_buffers_[kv_current_][i].get(), past_count, past_shape, std::size(past_shape));
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, kv_buffers_[kv_current_ ^ 1][i].get(), present_count, present_shape, std::size(present_shape));
+    inputs_[i + 3] = pasts_[i].get();
+    outputs_[i + 1] = presents_[i].get();
+  }
+
+  try {
+    model_.session_decoder_->Run(nullptr, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data(), outputs_.data(), output_names_.size());
+  } catch (const Ort::Exception& e) {
+    std::cout << e.what() << std::endl;
+  }
+
+  kv_current_ ^= 1;
+  length_ = static_cast<int>(length);
+
+  for (size_t i = 0; i < rows_.size(); i++) {
+    if (rows_[i])
+      rows_[i]->SelectNextToken(logits_.subspan(i * model_.vocab_size_, model_.vocab_size_));
+  }
+}
+
+}  // namespace Generators
@@ -0,0 +1,115 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+
+namespace Generators {
+
+struct GreedySearch;
+struct Gpt_State;
+
+// A request run by a Gpt_Engine, the tokens it generates are queued here as the engine steps
+struct Gpt_Request {
+  Gpt_Request(const SearchParams& params);
+  ~Gpt_Request();
+
+  // Moves the tokens generated since the last call onto the end of 'tokens'
+  void TakeTokens(std::vector<int32_t>& tokens);
+  // Takes the next generated token. Returns false if there is none yet, or true with no token once the request is done.
+  bool TakeToken(std::optional<int32_t>& token);
+  bool IsReady();  // True if a token is waiting or the request is done, so TakeToken will succeed
+  bool IsDone();   // Once done no more tokens are generated, though some may still be waiting to be taken
+
+ private:
+  friend struct Gpt_Engine;
+  void SelectNextToken(std::span<const ScoreType> logits);
+
+  std::vector<int32_t> input_ids_;
+  SearchParams params_;
+  std::unique_ptr<GreedySearch> search_;
+
+  std::mutex mutex_;  // The engine and the consumer of the tokens can be on different threads
+  std::deque<int32_t> output_;
+  bool done_{};
+};
+
+// Continuous batching on a Gpt_Model. There is one running decode batch, between steps finished requests leave it and
+// waiting requests are prefilled on their own then merged into it, into the rows the finished ones left where they fit.
+// Rows are right aligned to the longest row, with the start of shorter rows masked out. Greedy search only.
+struct Gpt_Engine {
+  // With 'disaggregated_prefill', prompts are prefilled on a thread of their own and Step only runs decode steps. A
+  // finished prefill's state is handed over as is and merged into the batch on the next Step, so a long prompt never
+  // holds up a decode step. If the model has a prefill session (see the Gpt_Model constructor taking prefill session
+  // options) the prefills run on its thread pool, otherwise they share the decoder's.
+  //
+  // A prefill's past state is copied into its row of the batch once. It can't be written there directly, as the past is
+  // shaped (2, rows, ...) and a row's keys and values are apart in it, while a prefill's present has them next to each
+  // other.
+  Gpt_Engine(const Gpt_Model& model, int max_batch_size, int max_length, bool disaggregated_prefill = false);
+  ~Gpt_Engine();
+
+  // Queue a request with a single prompt (params.batch_size == 1), it joins the batch on a following Step
+  std::shared_ptr<Gpt_Request> Add(const SearchParams& params);
+  void Add(std::shared_ptr<Gpt_Request> request);
+
+  // Retire finished requests, admit waiting ones and run a decode step. Returns false once there is nothing left to do.
+  bool Step();
+
+  size_t GetRequestCount() const;  // Requests in the batch or waiting to join it
+
+ private:
+  struct Prefill {
+    std::shared_ptr<Gpt_Request> request;
+    std::unique_ptr<Gpt_State> state;
+  };
+
+  Prefill RunPrefill(std::shared_ptr<Gpt_Request> request);
+  void PrefillThread();
+  void Relayout(std::vector<Prefill>& prefills);
+  void RunDecode();
+
+  const Gpt_Model& model_;
+  bool disaggregated_prefill_;
+  OrtAllocator& allocator_;
+  const OrtMemoryInfo& memory_info_;
+  int max_batch_size_;
+  int max_length_;
+
+  mutable std::mutex mutex_;                   // Guards waiting_ and, with disaggregated prefill, everything down to stop_
+  std::deque<std::shared_ptr<Gpt_Request>> waiting_;
+  std::thread prefill_thread_;
+  std::condition_variable prefill_condition_;  // Signalled when a request is waiting or rows have been freed, and on stop
+  std::condition_variable decode_condition_;   // Signalled when a prefill has finished
+  std::deque<Prefill> prefilled_;              // Prefilled requests waiting to be merged into the batch
+  size_t prefilling_{};                        // Requests being prefilled
+  size_t row_count_{};                         // Rows in the batch as of the last Step
+  bool stop_{};
+
+  std::vector<std::shared_ptr<Gpt_Request>> rows_;  // Request in each row of the batch, null for a hole left by a finished one
+  std::vector<int32_t> row_positions_;              // Next position id of each row
+  int length_{};                                    // Past length of the batch
+
+  // Two of each so a rebuild of the batch can copy from one into the other, the current one holds the batch
+  std::span<int32_t> masks_[2];  // shape (rows, length_)
+  Ort::IAllocatorUniquePtr<int32_t> mask_buffers_[2];
+  int mask_current_{};
+  std::vector<Ort::IAllocatorUniquePtr<ScoreType>> kv_buffers_[2];  // Per layer, shape (2, rows, head_count, length_, hidden_size)
+  int kv_current_{};
+
+  std::span<int32_t> input_ids_, position_ids_;  // shape (rows, 1)
+  Ort::IAllocatorUniquePtr<int32_t> input_ids_buffer_, position_ids_buffer_;
+  std::span<ScoreType> logits_;  // shape (rows, 1, vocab_size)
+  Ort::IAllocatorUniquePtr<ScoreType> logits_buffer_;
+
+  // The tensors are views of the buffers above, recreated every step as the shapes change
+  std::unique_ptr<OrtValue> input_ids_tensor_, position_ids_tensor_, attention_mask_tensor_, logits_tensor_;
+  std::vector<std::unique_ptr<OrtValue>> pasts_, presents_;
+
+  std::vector<std::string> input_name_strings_, output_name_strings_;
+  std::vector<const char*> input_names_, output_names_;
+  std::vector<OrtValue*> inputs_, outputs_;
+};
+
+}  // namespace Generators
@@ -0,0 +1,54 @@
+#include "../generators.h"
+#include "../search.h"
+#include "gpt_cpu.h"
+#include "gpt_pipeline.h"
+
+namespace Generators {
+
+Gpt_RunWorker::Gpt_RunWorker()
+    : thread_{&Gpt_RunWorker::Thread, this} {
+}
+
+Gpt_RunWorker::~Gpt_RunWorker() {
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    stop_ = true;
+    condition_.notify_all();
+  }
+  thread_.join();
+}
+
+void Gpt_RunWorker::Run(Gpt_State& state) {
+  std::lock_guard<std::mutex> lock{mutex_};
+  assert(!state_ && !finished_);
+  state_ = &state;
+  condition_.notify_all();
+}
+
+std::span<ScoreType> Gpt_RunWorker::Wait() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  condition_.wait(lock, [this] { return finished_; });
+  finished_ = false;
+  return logits_;
+}
+
+void Gpt_RunWorker::Thread() {
+  std::unique_lock<std::mutex> lock{mutex_};
+  while (true) {
+    condition_.wait(lock, [this] { return state_ || stop_; });
+    if (stop_)
+      return;
+
+    auto* state = state_;
+    state_ = nullptr;
+    lock.unlock();
+    auto logits = state->RunPrepared();
+    lock.lock();
+
+    logits_ = logits;
+    finished_ = true;
+    condition_.notify_all();
+  }
+}
+
+}  // namespace Generators
@@ -0,0 +1,90 @@
+#pragma once
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+
+namespace Generators {
+
+// A thread that runs prepared Gpt_States one at a time, for as long as it lives. A run is handed to it with Run and its
+// logits taken back with Wait, so a pipeline doesn't start a thread for every step.
+struct Gpt_RunWorker {
+  Gpt_RunWorker();
+  ~Gpt_RunWorker();
+
+  void Run(Gpt_State& state);    // Start RunPrepared on 'state', the previous run must have been waited for
+  std::span<ScoreType> Wait();  // Wait for the run to finish and return its logits
+
+ private:
+  void Thread();
+
+  std::mutex mutex_;
+  std::condition_variable condition_;  // Signalled when a run is handed over, when one finishes, and on stop
+  Gpt_State* state_{};                 // The run handed over and not started yet
+  std::span<ScoreType> logits_;
+  bool finished_{};
+  bool stop_{};
+  std::thread thread_;
+};
+
+// Runs two independent generations (micro batches) on one model as a ping-pong pipeline. While one micro batch is inside
+// OrtSession::Run on the worker thread, the other's search tail (SetLogits, 'scoring' and the input update for its next
+// tokens) runs on the calling thread, then they swap. 'scoring' is called with a search and does the processors and token
+// selection, as the body of a normal generation loop would.
+template <typename TSearch, typename TScoring>
+void RunPipelined(TSearch& search0, Gpt_State& state0, TSearch& search1, Gpt_State& state1, TScoring&& scoring) {
+  TSearch* searches[] = {&search0, &search1};
+  Gpt_State* states[] = {&state0, &state1};
+  std::span<ScoreType> logits[2];  // Logits of a finished run whose search step hasn't been done yet
+
+  auto search_step = [&](int index) {
+    searches[index]->SetLogits(logits[index]);
+    scoring(*searches[index]);
+    logits[index] = {};
+  };
+
+  auto prepare = [&](int index) {
+    auto& search = *searches[index];
+    if constexpr (std::is_same_v<TSearch, BeamSearch>)
+      states[index]->Prepare(search.GetSequenceLength(), search.GetNextTokens(), search.GetNextIndices());
+    else
+      states[index]->Prepare(search.GetSequenceLength(), search.GetNextTokens());
+  };
+
+  Gpt_RunWorker worker;
+
+  int active = 0;  // The micro batch inside Run
+  worker.Run(*states[active]);
+
+  while (true) {
+    int other = active ^ 1;
+
+    // Overlap the other micro batch's search step and input update with the active one's run
+    bool other_ready = false;
+    if (!searches[other]->IsDone()) {
+      if (!logits[other].empty())
+        search_step(other);
+      if (!searches[other]->IsDone()) {
+        prepare(other);
+        other_ready = true;
+      }
+    }
+
+    logits[active] = worker.Wait();
+
+    if (other_ready) {
+      active = other;
+      worker.Run(*states[active]);
+      continue;
+    }
+
+    // Nothing to overlap with, as the other micro batch is done
+    search_step(active);
+    if (searches[active]->IsDone())
+      break;
+    prepare(active);
+    worker.Run(*states[active]);
+  }
+}
+
+}  // namespace Generators
@@ -0,0 +1,113 @@
+#include "../generators.h"
+#include "onnxruntime_cxx_api_2.h"
+#include "gpt_common.h"
+#include "gpt_score.h"
+#include <iostream>
+
+namespace Generators {
+
+// log_softmax(scores)[token] without writing the scores, one pass for the max and one for the sum
+static ScoreType LogProbability(const ScoreType* scores, int vocab_size, int32_t token) {
+  ScoreType max = *std::max_element(scores, scores + vocab_size);
+  float sum = 0.0f;
+  for (int i = 0; i < vocab_size; i++)
+    sum += std::exp(scores[i] - max);
+  return scores[token] - max - std::log(sum);
+}
+
+std::vector<ScoreType> ScoreContinuations(const Gpt_Model& model, std::span<const std::span<const int32_t>> prompts,
+                                          std::span<const std::span<const int32_t>> continuations, int max_batch_size,
+                                          std::vector<ScoreType>* token_scores) {
+  assert(model.logits_uses_seq_len_ && prompts.size() == continuations.size() && max_batch_size > 0);
+  auto& allocator = *model.allocator_cpu_;
+  auto& memory_info = *allocator.Info(&allocator);
+  int vocab_size = model.vocab_size_;
+  size_t count = prompts.size();
+
+  std::vector<ScoreType> scores(count);
+  std::vector<size_t> token_offsets(count + 1);  // Where each continuation's tokens go in token_scores
+  for (size_t i = 0; i < count; i++)
+    token_offsets[i + 1] = token_offsets[i] + continuations[i].size();
+  if (token_scores)
+    token_scores->resize(token_offsets[count]);
+
+  std::vector<std::string> input_name_strings{"input_ids", "position_ids", "attention_mask"};
+  for (int i = 0; i < model.layer_count_; i++)
+    input_name_strings.push_back("past_" + std::to_string(i));
+  std::vector<const char*> input_names;
+  for (auto& name : input_name_strings)
+    input_names.push_back(name.c_str());
+  const char* output_name = "logits";  // The presents aren't needed, so they aren't fetched
+
+  for (size_t first = 0; first < count; first += max_batch_size) {
+    int64_t batch_size = static_cast<int64_t>(std::min<size_t>(max_batch_size, count - first));
+    int64_t length = 0;
+    for (int64_t i = 0; i < batch_size; i++) {
+      assert(!prompts[first + i].empty());
+      length = std::max<int64_t>(length, prompts[first + i].size() + continuations[first + i].size());
+    }
+
+    Ort::IAllocatorUniquePtr<int32_t> input_ids_buffer, position_ids_buffer, attention_mask_buffer;
+    auto input_ids = Allocate<int32_t>(allocator, batch_size * length, input_ids_buffer);
+    auto position_ids = Allocate<int32_t>(allocator, batch_size * length, position_ids_buffer);
+    auto attention_mask = Allocate<int32_t>(allocator, batch_size * length, attention_mask_buffer);
+
+    // The attention mask excludes the padding, so any token id does for it. The positions start after it, the same as
+    // an unpadded row's.
+    for (int64_t i = 0; i < batch_size; i++) {
+      auto prompt = prompts[first + i];
+      auto continuation = continuations[first + i];
+      int64_t pad_length = length - static_cast<int64_t>(prompt.size() + continuation.size());
+      int32_t* row_ids = input_ids.data() + i * length;
+      for (int64_t j = 0; j < length; j++) {
+        bool pad = j < pad_length;
+        attention_mask[i * length + j] = pad ? 0 : 1;
+        position_ids[i * length + j] = pad ? 0 : static_cast<int32_t>(j - pad_length);
+      }
+      std::fill(row_ids, row_ids + pad_length, 0);
+      std::copy(prompt.data(), prompt.data() + prompt.size(), row_ids + pad_length);
+      std::copy(continuation.data(), continuation.data() + continuation.size(), row_ids + pad_length + prompt.size());
+    }
+
+    int64_t ids_shape[] = {batch_size, length};
+    auto input_ids_tensor = OrtValue::CreateTensor<int32_t>(memory_info, input_ids.data(), input_ids.size(), ids_shape, std::size(ids_shape));
+    auto position_ids_tensor = OrtValue::CreateTensor<int32_t>(memory_info, position_ids.data(), position_ids.size(), ids_shape, std::size(ids_shape));
+    auto attention_mask_tensor = OrtValue::CreateTensor<int32_t>(memory_info, attention_mask.data(), attention_mask.size(), ids_shape, std::size(ids_shape));
+
+    int64_t empty_past_shape[] = {2, batch_size, model.head_count_, 0, model.hidden_size_};
+    auto empty_past = OrtValue::CreateTensor(allocator, empty_past_shape, std::size(empty_past_shape), Ort::TypeToTensorType<ScoreType>::type);
+
+    std::vector<OrtValue*> inputs{input_ids_tensor.get(), position_ids_tensor.get(), attention_mask_tensor.get()};
+    for (int i = 0; i < model.layer_count_; i++)
+      inputs.push_back(empty_past.get());
+
+    Ort::IAllocatorUniquePtr<ScoreType> logits_buffer;
+    auto logits = Allocate<ScoreType>(allocator, batch_size * length * vocab_size, logits_buffer);
+    int64_t logits_shape[] = {batch_size, length, vocab_size};
+    auto logits_tensor = OrtValue::CreateTensor<ScoreType>(memory_info, logits.data(), logits.size(), logits_shape, std::size(logits_shape));
+    OrtValue* outputs[] = {logits_tensor.get()};
+
+    try {
+      model.session_decoder_->Run(nullptr, input_names.data(), inputs.data(), inputs.size(), &output_name, outputs, 1);
+    } catch (const Ort::Exception& e) {
+      std::cout << e.what() << std::endl;
+    }
+
+    // The logits at a position score the token after it, so the continuation is scored from the last prompt position on
+    for (int64_t i = 0; i < batch_size; i++) {
+      auto continuation = continuations[first + i];
+      int64_t start = length - static_cast<int64_t>(continuation.size());
+      for (size_t j = 0; j < continuation.size(); j++) {
+        const ScoreType* position_logits = logits.data() + (i * length + start + j - 1) * vocab_size;
+        ScoreType score = LogProbability(position_logits, vocab_size, continuation[j]);
+        scores[first + i] += score;
+        if (token_scores)
+          (*token_scores)[token_offsets[first + i] + j] = score;
+      }
+    }
+  }
+
+  return scores;
+}
+
+}  // namespace Generators
@@ -0,0 +1,16 @@
+#pragma once
+
+namespace Generators {
+
+// Log likelihood of continuations given their prompts, for reranking and evaluation. The (prompt, continuation) pairs are
+// left padded into batches of at most 'max_batch_size' rows, and each batch runs prompt plus continuation in a single
+// pass with an empty past, so nothing is generated. Only the continuation tokens' log probabilities are taken from the
+// logits, the log softmax is fused into that gather. The model needs logits for every position and prompts at least a token.
+//
+// Returns the sum of each continuation's token log probabilities. If 'token_scores' is given it gets every token's, the
+// continuations one after the other.
+std::vector<ScoreType> ScoreContinuations(const Gpt_Model& model, std::span<const std::span<const int32_t>> prompts,
+                                          std::span<const std::span<const int32_t>> continuations, int max_batch_size,
+                                          std::vector<ScoreType>* token_scores = nullptr);
+
+}  // namespace Generators
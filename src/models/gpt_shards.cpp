@@ -0,0 +1,174 @@
+#include "../generators.h"
+#include "onnxruntime_cxx_api_2.h"
+#include "gpt_common.h"
+#include "gpt_engine.h"
+#include "gpt_shards.h"
+#include <fstream>
+#include <string>
+#ifdef _WIN32
+#include <windows.h>
+#elif defined(__linux__)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+namespace Generators {
+
+// Parses a Linux cpulist like "0-3,8-11"
+static std::vector<int> ParseCpuList(const std::string& list) {
+  std::vector<int> cpus;
+  size_t start = 0;
+  while (start < list.size()) {
+    size_t end = list.find(',', start);
+    if (end == std::string::npos)
+      end = list.size();
+
+    auto range = list.substr(start, end - start);
+    size_t dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+
+    start = end + 1;
+  }
+  return cpus;
+}
+
+std::vector<std::vector<int>> GetNumaNodeCpus() {
+  std::vector<std::vector<int>> nodes;
+#ifdef __linux__
+  for (int node = 0;; node++) {
+    std::ifstream file{"/sys/devices/system/node/node" + std::to_string(node) + "/cpulist"};
+    std::string list;
+    if (!std::getline(file, list))
+      break;
+    if (auto cpus = ParseCpuList(list); !cpus.empty())
+      nodes.push_back(std::move(cpus));
+  }
+#endif
+
+  if (nodes.empty()) {
+    nodes.emplace_back(std::max(1u, std::thread::hardware_concurrency()));
+    std::iota(nodes[0].begin(), nodes[0].end(), 0);
+  }
+  return nodes;
+}
+
+void PinCurrentThread(const std::vector<int>& cpus) {
+#ifdef _WIN32
+  // Windows splits the CPUs into processor groups of up to 64, and a thread runs in one group. The cpus number every
+  // group's CPUs in order, the thread is pinned to the ones in the first cpu's group.
+  GROUP_AFFINITY affinity{};
+  bool has_group{};
+  WORD group_count = GetActiveProcessorGroupCount();
+  for (int cpu : cpus) {
+    WORD group = 0;
+    DWORD index = static_cast<DWORD>(cpu);
+    while (group < group_count && index >= GetActiveProcessorCount(group))
+      index -= GetActiveProcessorCount(group++);
+    if (group == group_count || (has_group && group != affinity.Group))
+      continue;
+
+    affinity.Group = group;
+    affinity.Mask |= KAFFINITY{1} << index;
+    has_group = true;
+  }
+  if (has_group)
+    SetThreadGroupAffinity(GetCurrentThread(), &affinity, nullptr);
+#elif defined(__linux__)
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (int cpu : cpus)
+    CPU_SET(cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#endif
+}
+
+Gpt_Shards::Gpt_Shards(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, std::vector<std::vector<int>> shard_cpus, int max_batch_size, int max_length) {
+  for (auto& cpus : shard_cpus) {
+    auto& shard = *shards_.emplace_back(std::make_unique<Shard>());
+    shard.cpus_ = std::move(cpus);
+    shard.thread_ = std::thread(&Gpt_Shards::ShardThread, this, std::ref(shard), std::ref(ort_env), decoder_path, max_batch_size, max_length);
+  }
+
+  // The shards load their model on their own thread, wait for them as decoder_path only lives until we return
+  for (auto& shard : shards_) {
+    std::unique_lock<std::mutex> lock{shard->mutex_};
+    shard->condition_.wait(lock, [&shard] { return shard->ready_; });
+  }
+}
+
+Gpt_Shards::~Gpt_Shards() {
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock{shard->mutex_};
+    shard->stop_ = true;
+    shard->condition_.notify_all();
+  }
+  for (auto& shard : shards_)
+    shard->thread_.join();
+}
+
+std::shared_ptr<Gpt_Request> Gpt_Shards::Add(const SearchParams& params) {
+  auto request = std::make_shared<Gpt_Request>(params);
+
+  Shard* least_loaded{};
+  size_t least_load{};
+  for (auto& shard : shards_) {
+    std::lock_guard<std::mutex> lock{shard->mutex_};
+    if (!least_loaded || shard->load_ < least_load) {
+      least_loaded = shard.get();
+      least_load = shard->load_;
+    }
+  }
+
+  std::lock_guard<std::mutex> lock{least_loaded->mutex_};
+  least_loaded->added_.push_back(request);
+  least_loaded->load_++;
+  least_loaded->condition_.notify_all();
+  return request;
+}
+
+void Gpt_Shards::ShardThread(Shard& shard, OrtEnv& ort_env, const ORTCHAR_T* decoder_path, int max_batch_size, int max_length) {
+  PinCurrentThread(shard.cpus_);
+
+  // The thread calling Run is one of the intra op threads, ORT pins the others (its processor numbers start at 1)
+  auto session_options = OrtSessionOptions::Create();
+  session_options->SetIntraOpNumThreads(static_cast<int>(shard.cpus_.size()));
+  std::string affinities;
+  for (size_t i = 1; i < shard.cpus_.size(); i++) {
+    if (i > 1)
+      affinities += ';';
+    affinities += std::to_string(shard.cpus_[i] + 1);
+  }
+  if (!affinities.empty())
+    session_options->AddConfigEntry("session.intra_op_thread_affinities", affinities.c_str());
+
+  shard.model_ = std::make_unique<Gpt_Model>(ort_env, decoder_path, *session_options);
+  shard.engine_ = std::make_unique<Gpt_Engine>(*shard.model_, max_batch_size, max_length);
+  {
+    std::lock_guard<std::mutex> lock{shard.mutex_};
+    shard.ready_ = true;
+    shard.condition_.notify_all();
+  }
+
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock{shard.mutex_};
+      if (shard.stop_)
+        break;
+      for (auto& request : shard.added_)
+        shard.engine_->Add(std::move(request));
+      shard.added_.clear();
+    }
+
+    bool stepped = shard.engine_->Step();
+
+    std::unique_lock<std::mutex> lock{shard.mutex_};
+    shard.load_ = shard.engine_->GetRequestCount() + shard.added_.size();
+    if (!stepped)
+      shard.condition_.wait(lock, [&shard] { return !shard.added_.empty() || shard.stop_; });
+  }
+}
+
+}  // namespace Generators
@@ -0,0 +1,44 @@
+#pragma once
+#include <condition_variable>
+#include <thread>
+
+namespace Generators {
+
+// The CPUs of each NUMA node. Where the topology isn't known this is a single node with every CPU.
+std::vector<std::vector<int>> GetNumaNodeCpus();
+
+// Restricts the calling thread to the given CPUs
+void PinCurrentThread(const std::vector<int>& cpus);
+
+// Runs one Gpt_Engine per NUMA node, or per CPU set to emulate nodes. Each shard's thread is pinned to its CPUs and
+// creates the shard's own session, so the weights (first touched by that thread), the engine's past state buffers, the
+// session's intra op threads and the search all stay on the node. Requests go to the least loaded shard.
+struct Gpt_Shards {
+  Gpt_Shards(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, std::vector<std::vector<int>> shard_cpus, int max_batch_size, int max_length);
+  ~Gpt_Shards();
+
+  std::shared_ptr<Gpt_Request> Add(const SearchParams& params);
+
+  int GetVocabSize() const { return shards_[0]->model_->GetVocabSize(); }
+
+ private:
+  struct Shard {
+    std::vector<int> cpus_;
+    std::unique_ptr<Gpt_Model> model_;
+    std::unique_ptr<Gpt_Engine> engine_;
+    std::thread thread_;
+
+    std::mutex mutex_;
+    std::condition_variable condition_;  // Signalled when a request is added, on stop, and once the shard is ready
+    std::vector<std::shared_ptr<Gpt_Request>> added_;
+    size_t load_{};  // Requests in the engine after its last step, plus the ones added since
+    bool ready_{};
+    bool stop_{};
+  };
+
+  void ShardThread(Shard& shard, OrtEnv& ort_env, const ORTCHAR_T* decoder_path, int max_batch_size, int max_length);
+
+  std::vector<std::unique_ptr<Shard>> shards_;
+};
+
+}  // namespace Generators
@@ -0,0 +1,213 @@
+#include "../generators.h"
+#include "../search.h"
+#include "gpt_cpu.h"
+#include "gpt_speculative.h"
+
+namespace Generators {
+
+void SoftMax(std::span<ScoreType> scores, float temperature);
+
+Gpt_Speculative::Gpt_Speculative(const Gpt_Model& model, const Gpt_Model& draft_model, const SearchParams& params, int draft_length,
+                                 float temperature, uint32_t seed)
+    : params_{params},
+      input_ids_(params.input_ids.data(), params.input_ids.data() + params.input_ids.size()),
+      draft_length_{draft_length},
+      temperature_{temperature},
+      generator_{seed},
+      sequences_{params.input_ids, params.batch_size, params.num_beams, params.max_length} {
+  assert(params_.batch_size == 1 && params_.num_beams == 1 && draft_length_ > 0);
+  assert(draft_model.GetVocabSize() == model.GetVocabSize());
+  params_.input_ids = input_ids_;
+
+  state_ = std::make_unique<Gpt_State>(model, std::span<int32_t>(&sequence_length_, 1), params_);
+  draft_state_ = std::make_unique<Gpt_State>(draft_model, std::span<int32_t>(&sequence_length_, 1), params_);
+  draft_probs_.resize(static_cast<size_t>(draft_length_) * params_.vocab_size);
+
+  // Run the prompt on both, the first token is the model's. The draft's logits aren't used, its first proposal comes after.
+  draft_state_->Run(sequences_.GetSequenceLength(), {});
+  AppendToken(PickToken(state_->Run(sequences_.GetSequenceLength(), {})));
+}
+
+Gpt_Speculative::Gpt_Speculative(const Gpt_Model& model, const SearchParams& params, int draft_length, int ngram_size,
+                                 float temperature, uint32_t seed)
+    : params_{params},
+      input_ids_(params.input_ids.data(), params.input_ids.data() + params.input_ids.size()),
+      draft_length_{draft_length},
+      temperature_{temperature},
+      generator_{seed},
+      sequences_{params.input_ids, params.batch_size, params.num_beams, params.max_length},
+      ngram_size_{ngram_size},
+      ngram_positions_(ngram_size) {
+  assert(params_.batch_size == 1 && params_.num_beams == 1 && draft_length_ > 0 && ngram_size_ > 0);
+  params_.input_ids = input_ids_;
+
+  state_ = std::make_unique<Gpt_State>(model, std::span<int32_t>(&sequence_length_, 1), params_);
+  if (temperature_ > 0.0f)
+    draft_probs_.resize(static_cast<size_t>(draft_length_) * params_.vocab_size);
+
+  AppendToken(PickToken(state_->Run(sequences_.GetSequenceLength(), {})));
+}
+
+Gpt_Speculative::~Gpt_Speculative() = default;
+
+int Gpt_Speculative::GetPastLength() const {
+  return state_->GetPastLength();
+}
+
+int32_t Gpt_Speculative::PickToken(std::span<ScoreType> logits) {
+  if (temperature_ <= 0.0f)
+    return static_cast<int32_t>(std::distance(logits.begin(), std::max_element(logits.begin(), logits.end())));
+
+  SoftMax(logits, temperature_);
+  std::discrete_distribution<int32_t> distribution(logits.begin(), logits.end());
+  return distribution(generator_);
+}
+
+void Gpt_Speculative::AppendToken(int32_t token) {
+  sequences_.AppendNextTokenToSequences(std::span<const int32_t>(&token, 1));
+  if (token == params_.eos_token_id || sequences_.GetSequenceLength() == params_.max_length)
+    done_ = true;
+}
+
+void Gpt_Speculative::Step() {
+  assert(!done_);
+  auto sequence = GetSequence();
+  int length = sequences_.GetSequenceLength();
+  int vocab_size = params_.vocab_size;
+
+  // Every token checked takes a position of past state, so only propose what fits before max_length
+  int draft_count = std::min(draft_length_, params_.max_length - length - 1);
+
+  // The model runs the last token of the sequence (which no past state has yet) followed by the proposed tokens
+  draft_tokens_.assign(1, sequence[length - 1]);
+  if (draft_state_)
+    ProposeWithDraft(draft_count);
+  else
+    ProposeWithLookup(draft_count);
+  draft_count = static_cast<int>(draft_tokens_.size()) - 1;
+
+  // Logits at position i of the check are the model's scores for proposed token i + 1
+  auto logits = state_->RunTokens(draft_tokens_, static_cast<int>(draft_tokens_.size()));
+  drafted_count_ += draft_count;
+
+  int accepted = 0;
+  int32_t token;  // The model's own token after the accepted ones
+  while (true) {
+    std::span<ScoreType> scores = logits.subspan(accepted * vocab_size, vocab_size);
+    if (accepted == draft_count) {  // Every proposed token was accepted, this is the bonus token
+      token = PickToken(scores);
+      break;
+    }
+
+    int32_t draft_token = draft_tokens_[accepted + 1];
+    if (temperature_ <= 0.0f) {
+      token = PickToken(scores);
+      if (token != draft_token)
+        break;
+    } else {
+      // Accept with probability min(1, p / q), on rejection sample from the leftover max(0, p - q) instead
+      SoftMax(scores, temperature_);
+      const ScoreType* draft_probs = draft_probs_.data() + accepted * vocab_size;
+      std::uniform_real_distribution<float> uniform;
+      if (uniform(generator_) * draft_probs[draft_token] >= scores[draft_token]) {
+        for (int i = 0; i < vocab_size; i++)
+          scores[i] = std::max(scores[i] - draft_probs[i], 0.0f);
+        std::discrete_distribution<int32_t> distribution(scores.begin(), scores.end());
+        token = distribution(generator_);
+        break;
+      }
+    }
+    accepted++;
+  }
+  accepted_count_ += accepted;
+
+  for (int i = 1; i <= accepted && !done_; i++)
+    AppendToken(draft_tokens_[i]);
+  if (!done_)
+    AppendToken(token);
+
+  // Roll back the past state of the rejected tokens. The draft only keeps what it ran of the accepted tokens.
+  int past_length = sequences_.GetSequenceLength() - 1;
+  state_->Truncate(std::min(past_length, state_->GetPastLength()));
+  if (draft_state_)
+    draft_state_->Truncate(std::min(past_length, draft_state_->GetPastLength()));
+}
+
+void Gpt_Speculative::ProposeWithDraft(int draft_count) {
+  if (draft_count == 0)
+    return;
+
+  auto sequence = GetSequence();
+  int length = sequences_.GetSequenceLength();
+  int vocab_size = params_.vocab_size;
+
+  // The draft first catches up on the tokens appended since its past state, the last of them proposes the first token
+  std::span<const int32_t> new_tokens = sequence.subspan(draft_state_->GetPastLength(), length - draft_state_->GetPastLength());
+  auto logits = draft_state_->RunTokens(new_tokens, static_cast<int>(new_tokens.size()));
+  for (int i = 0; i < draft_count; i++) {
+    std::span<ScoreType> probs(draft_probs_.data() + i * vocab_size, vocab_size);
+    copy(std::span<const ScoreType>(logits.data() + logits.size() - vocab_size, vocab_size), probs);
+    draft_tokens_.push_back(PickToken(probs));
+    if (i + 1 < draft_count)
+      logits = draft_state_->RunTokens(std::span<const int32_t>(&draft_tokens_.back(), 1), 1);
+  }
+}
+
+// The hash of the n tokens before a position is built up from the token before it backwards, one token per n
+static uint64_t HashNextToken(uint64_t hash, int32_t token) {
+  return hash * 1000003 + static_cast<uint32_t>(token);
+}
+
+void Gpt_Speculative::IndexNgrams() {
+  auto sequence = GetSequence();
+  int length = sequences_.GetSequenceLength();
+
+  // Only positions with a token after them are indexed, the latest position of an n-gram replaces any earlier one
+  for (; indexed_length_ < length; indexed_length_++) {
+    uint64_t hash = 0;
+    for (int n = 1; n <= ngram_size_ && n <= indexed_length_; n++) {
+      hash = HashNextToken(hash, sequence[indexed_length_ - n]);
+      ngram_positions_[n - 1][hash] = indexed_length_;
+    }
+  }
+}
+
+void Gpt_Speculative::ProposeWithLookup(int draft_count) {
+  IndexNgrams();
+  if (draft_count == 0)
+    return;
+
+  auto sequence = GetSequence();
+  int length = sequences_.GetSequenceLength();
+  int max_n = std::min(ngram_size_, length);
+
+  std::vector<uint64_t> hashes(max_n);
+  uint64_t hash = 0;
+  for (int n = 1; n <= max_n; n++)
+    hashes[n - 1] = hash = HashNextToken(hash, sequence[length - n]);
+
+  // The longest n-gram that matched before wins, the hash could collide so the tokens are compared too
+  for (int n = max_n; n >= 1; n--) {
+    auto found = ngram_positions_[n - 1].find(hashes[n - 1]);
+    if (found == ngram_positions_[n - 1].end())
+      continue;
+    int position = found->second;
+    if (!std::equal(sequence.data() + position - n, sequence.data() + position, sequence.data() + length - n))
+      continue;
+
+    int count = std::min(draft_count, length - position);
+    draft_tokens_.insert(draft_tokens_.end(), sequence.data() + position, sequence.data() + position + count);
+    break;
+  }
+
+  // For rejection sampling the proposals have a probability of 1
+  if (temperature_ > 0.0f) {
+    for (size_t i = 1; i < draft_tokens_.size(); i++) {
+      std::span<ScoreType> probs(draft_probs_.data() + (i - 1) * params_.vocab_size, params_.vocab_size);
+      std::fill(probs.begin(), probs.end(), 0.0f);
+      probs[draft_tokens_[i]] = 1.0f;
+    }
+  }
+}
+
+}  // namespace Generators
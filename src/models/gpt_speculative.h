@@ -0,0 +1,65 @@
+#pragma once
+#include <random>
+#include <unordered_map>
+
+namespace Generators {
+
+// Speculative decoding of a single sequence (params.batch_size == 1, no beams). Every Step up to 'draft_length' tokens are
+// proposed, then the model checks them all in one Gpt_State::RunTokens. The accepted tokens plus one from the model are
+// appended, so a step adds between 1 and draft_length + 1 tokens, and the past state is truncated back to them.
+//
+// The tokens are proposed either by a small draft model, one at a time, or by prompt lookup: the last tokens of the
+// sequence are looked up in an index of the n-grams earlier in the sequence (the prompt and the output so far), and the
+// tokens that followed the latest match are proposed. This needs no extra model and does well when the output copies
+// spans of the prompt, as in summarization or code editing.
+//
+// With a temperature of 0 a draft token is accepted if it's the model's argmax, so the output is the same as greedy search
+// on the model. Otherwise the tokens are sampled at the temperature and checked by rejection sampling, so the output has
+// the model's distribution. The models need logits for every position, and a draft model the same vocabulary.
+struct Gpt_Speculative {
+  Gpt_Speculative(const Gpt_Model& model, const Gpt_Model& draft_model, const SearchParams& params, int draft_length,
+                  float temperature = 0.0f, uint32_t seed = std::random_device{}());
+
+  // Prompt lookup, matching the longest n-gram of at most 'ngram_size' tokens
+  Gpt_Speculative(const Gpt_Model& model, const SearchParams& params, int draft_length, int ngram_size,
+                  float temperature = 0.0f, uint32_t seed = std::random_device{}());
+  ~Gpt_Speculative();
+
+  void Step();
+  bool IsDone() const { return done_; }
+
+  std::span<int32_t> GetSequence() { return sequences_.GetSequence(0); }
+  int GetPastLength() const;  // The model's past state, every token of the sequence but the last once a Step is done
+
+  int drafted_count_{};   // Draft tokens proposed
+  int accepted_count_{};  // Draft tokens accepted
+
+ private:
+  int32_t PickToken(std::span<ScoreType> logits);  // Greedy or sampled, 'logits' is turned into probabilities if sampling
+  void AppendToken(int32_t token);
+  void ProposeWithDraft(int draft_count);
+  void ProposeWithLookup(int draft_count);
+  void IndexNgrams();
+
+  SearchParams params_;
+  std::vector<int32_t> input_ids_;
+  int draft_length_;
+  float temperature_;
+  std::mt19937 generator_;
+
+  Sequences sequences_;
+  int32_t sequence_length_;  // Non pad prompt length, for the Gpt_State constructors
+  std::unique_ptr<Gpt_State> state_, draft_state_;  // No draft_state_ for prompt lookup
+  bool done_{};
+
+  // Prompt lookup, for each n the position after the latest n-gram with a given hash
+  int ngram_size_{};
+  std::vector<std::unordered_map<uint64_t, int>> ngram_positions_;
+  int indexed_length_{};  // The n-grams before this position are indexed
+
+  std::vector<int32_t> draft_tokens_;    // The first is the last token of the sequence, then the proposed tokens
+  std::vector<ScoreType> draft_probs_;   // Draft probabilities of each proposed token, shape (draft_length, vocab_size). One
+                                         // hot for prompt lookup, as its proposals are certain.
+};
+
+}  // namespace Generators
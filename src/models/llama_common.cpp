@@ -27,6 +27,8 @@ Llama_Model::Llama_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path, cudaStr
 #endif
 
 void Llama_Model::InitModelParams() {
+  allocator_cpu_ = &Ort::Allocator::GetWithDefaultOptions();
+
   // We could use this to determine the vocabulary size and if the logits has a width of 1
   auto logits_shape = session_decoder_->GetOutputTypeInfo(0)->GetTensorTypeAndShapeInfo().GetShape();
   assert(logits_shape.size() == 3);
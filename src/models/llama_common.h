@@ -2,6 +2,9 @@
 
 namespace Generators {
 
+// The loaded model, running it doesn't change it. All of a generation's state lives in a Llama_State, so one model can be
+// shared by any number of states running concurrently on different threads (OrtSession::Run is thread safe). On CUDA the
+// states share the model's stream, so their runs are serialized on it.
 struct Llama_Model {
   Llama_Model(OrtEnv& ort_env, const ORTCHAR_T* decoder_path);
 #ifdef USE_CUDA
@@ -14,6 +17,10 @@ struct Llama_Model {
 
   std::unique_ptr<OrtSession> session_decoder_;
 
+  // Allocator the CPU states create their tensors with, it can be replaced before creating a state (to track allocations).
+  // Every state uses it, so it must be thread safe if the states run on different threads.
+  OrtAllocator* allocator_cpu_{};
+
   // Model parameters:
   int vocab_size_{};
   int head_count_{};
@@ -2,51 +2,49 @@
 #include "../search.h"
 #include "llama_cpu.h"
 #include "debugging.h"
+#include "model_rows.h"
 #include <iostream>
 
 namespace Generators {
 
-Llama_State::Llama_State(Llama_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& search_params)
- : model_{&model},
-  search_params_{search_params} {
+Llama_State::Llama_State(const Llama_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& search_params)
+ : search_params_{search_params},
+  model_{&model},
+  allocator_{*model.allocator_cpu_},
+  memory_info_{*allocator_.Info(&allocator_)} {
 
+  // The prompt is the same for every beam (or returned sequence), so it's run once per batch row and broadcast to the
+  // row's beams afterwards
   int64_t input_ids_shape[] = {search_params_.batch_size, search_params_.sequence_length};
+  int64_t batch_size = search_params_.batch_size;
+  int64_t batch_beam_size = search_params_.BatchBeamSize();
 
   // Allocate position_ids and attention_mask based on shape of input_ids
   auto element_type = Ort::TypeToTensorType<int64_t>::type;
-  auto& allocator = Ort::Allocator::GetWithDefaultOptions();
-
-  const OrtMemoryInfo& location = allocator.GetInfo();
+  auto& allocator = allocator_;
 
   // Use original input_ids. This requires the input_ids for subgraph is also int32.
   // Current shape is (batch_size, sequence_length)
-  // Note that we will expand it to (batch_size * num_beams, sequence_length) later.
-  // To avoid cloning input_ids, we use const_cast here since this function does not change its content.
   input_ids_ = OrtValue::CreateTensor<int64_t>(allocator, input_ids_shape, std::size(input_ids_shape));
   auto *p_data=input_ids_->GetTensorMutableData<int64_t>();
   for (auto v : search_params_.input_ids)
     *p_data++ = v;
   position_ids_ = OrtValue::CreateTensor<int64_t>(allocator, input_ids_shape, std::size(input_ids_shape));
 
-  int64_t position_shape[] = {search_params_.batch_size * search_params_.num_beams, 1};
+  int64_t position_shape[] = {batch_beam_size, 1};
   next_positions_ = Allocate<int64_t>(allocator, position_shape[0], next_positions_buffer_);
   memset(next_positions_.data(), 0, next_positions_.size_bytes());
-  next_positions_tensor_ = OrtValue::CreateTensor<int64_t>(allocator.GetInfo(), next_positions_.data(), next_positions_.size(), position_shape, std::size(position_shape));
-
-//   void* attn_mask_value = nullptr;  // TODO: Temporary hack until needed
-// #if 0
-//   attention_mask_;
-//   if (attn_mask_value != nullptr) {
-//     const Tensor& attn_mask = attn_mask_value->Get<Tensor>();
-//     Tensor::InitOrtValue(element_type, input_ids_shape, const_cast<Tensor*>(&attn_mask)->MutableData<int32_t>(),
-//                          allocator->Info(), attention_mask);
-//   } else {
-// #endif
-  attention_mask_ = OrtValue::CreateTensor<int64_t>(allocator, input_ids_shape, std::size(input_ids_shape));
+  next_positions_tensor_ = OrtValue::CreateTensor<int64_t>(memory_info_, next_positions_.data(), next_positions_.size(), position_shape, std::size(position_shape));
+
+  next_input_ids_ = Allocate<int64_t>(allocator, position_shape[0], next_input_ids_buffer_);
+  next_input_ids_tensor_ = OrtValue::CreateTensor<int64_t>(memory_info_, next_input_ids_.data(), next_input_ids_.size(), position_shape, std::size(position_shape));
+
+  attention_mask_ = Allocate<int64_t>(allocator, batch_beam_size * search_params_.max_length, attention_mask_buffer_);
+  pad_counts_ = Allocate<int32_t>(allocator, batch_beam_size, pad_counts_buffer_);
 
   // Set attention mask to be 0 for pad tokens, and 1 for all other tokens.
   // Set position id to be 0 for pad tokens, and accumulated sum of mask in a batch for other tokens
-  int64_t* mask_data = attention_mask_->GetTensorMutableData<int64_t>();
+  int64_t* mask_data = attention_mask_.data();
   int64_t* position_data = position_ids_->GetTensorMutableData<int64_t>();
   const int32_t* word_id = search_params_.input_ids.data();
   int64_t* mask = mask_data;
@@ -64,17 +62,15 @@ Llama_State::Llama_State(Llama_Model& model, std::span<int32_t> sequence_lengths
       }
     }
 
-    for (int k = 0; k < search_params_.num_beams; k++) {
-      sequence_lengths[i * search_params_.num_beams + k] = static_cast<int32_t>(abs_position);
+    for (int k = 0; k < search_params_.RowsPerPrompt(); k++) {
+      sequence_lengths[i * search_params_.RowsPerPrompt() + k] = static_cast<int32_t>(abs_position);
+      pad_counts_[i * search_params_.RowsPerPrompt() + k] = search_params_.sequence_length - static_cast<int32_t>(abs_position);
     }
   }
 
-  assert(search_params_.num_beams == 1);
-  expanded_input_ids_ = std::move(input_ids_);
-  expanded_position_ids_ = std::move(position_ids_);
-  expanded_attention_mask_ = std::move(attention_mask_);
+  expanded_attention_mask_ = OrtValue::CreateTensor<int64_t>(memory_info_, mask_data, batch_size * search_params_.sequence_length, input_ids_shape, std::size(input_ids_shape));
 
-  for (auto* input : {expanded_input_ids_.get(), expanded_position_ids_.get(), expanded_attention_mask_.get()})
+  for (auto* input : {input_ids_.get(), position_ids_.get(), expanded_attention_mask_.get()})
     inputs_.push_back(input);
   for (auto* name : {"input_ids", "position_ids", "attention_mask"})
     input_name_strings_.push_back(name);
@@ -83,13 +79,12 @@ Llama_State::Llama_State(Llama_Model& model, std::span<int32_t> sequence_lengths
 
   auto past_type = Ort::TypeToTensorType<ScoreType>::type;
   // Initialize empty past state
-  int64_t empty_past_shape[] = {search_params_.batch_size * search_params_.num_beams, model_->head_count_, 0, model_->hidden_size_};
+  int64_t empty_past_shape[] = {batch_size, model_->head_count_, 0, model_->hidden_size_};
   empty_past_ = OrtValue::CreateTensor(allocator, empty_past_shape, std::size(empty_past_shape), past_type);
   for (int i = 0; i < model_->layer_count_ * 2; i++)
     inputs_.push_back(empty_past_.get());
 
   // Initialize non empty past states
-  int64_t past_shape[] = {search_params_.batch_size * search_params_.num_beams, model_->head_count_, input_ids_shape[1], model_->hidden_size_};
   pasts_.resize(model_->layer_count_ * 2);
 
   // The remaining inputs are past state.
@@ -102,23 +97,31 @@ Llama_State::Llama_State(Llama_Model& model, std::span<int32_t> sequence_lengths
     input_name_strings_.push_back(string);
   }
 
-  // Allocate space for logits (only works if we know the shape)
+  // Allocate space for logits, only the last position is used. The prefill only fills the first batch_size rows (see
+  // RunPrefill and BroadcastPrefill).
   {
-    int64_t logits_shape[] = {search_params_.batch_size * search_params_.num_beams, model_->logits_uses_seq_len_ ? input_ids_shape[1] : 1, model_->vocab_size_};
-    logits_ = OrtValue::CreateTensor(allocator, logits_shape, std::size(logits_shape), past_type);
-    outputs_.push_back(logits_.get());
+    int64_t logits_shape[] = {batch_size, 1, model_->vocab_size_};
+    logits_ = Allocate<ScoreType>(allocator, batch_beam_size * model_->vocab_size_, logits_buffer_);
+    logits_tensor_ = OrtValue::CreateTensor<ScoreType>(memory_info_, logits_.data(), batch_size * model_->vocab_size_, logits_shape, std::size(logits_shape));
+    outputs_.push_back(logits_tensor_.get());
   }
 
   {
-    int64_t present_shape[] = {search_params_.batch_size * search_params_.num_beams, model_->head_count_, input_ids_shape[1], model_->hidden_size_};
+    int64_t present_shape[] = {batch_size, model_->head_count_, input_ids_shape[1], model_->hidden_size_};
+    size_t present_count = present_shape[0] * present_shape[1] * present_shape[2] * present_shape[3];
+    size_t buffer_count = batch_beam_size * model_->head_count_ * search_params_.max_length * model_->hidden_size_;
     outputs_.reserve(model_->layer_count_ * 2);
+    past_buffers_.resize(model_->layer_count_ * 2);
+    present_buffers_.resize(model_->layer_count_ * 2);
 
-    for (int i = 0; i < model_->layer_count_; ++i) {
-      presents_.push_back(OrtValue::CreateTensor(allocator, present_shape, std::size(present_shape), past_type));
-      outputs_.push_back(presents_.back().get());
-      presents_.push_back(OrtValue::CreateTensor(allocator, present_shape, std::size(present_shape), past_type));
+    for (int i = 0; i < model_->layer_count_ * 2; ++i) {
+      Allocate<ScoreType>(allocator, buffer_count, past_buffers_[i]);
+      Allocate<ScoreType>(allocator, buffer_count, present_buffers_[i]);
+      presents_.push_back(OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape, std::size(present_shape)));
       outputs_.push_back(presents_.back().get());
+    }
 
+    for (int i = 0; i < model_->layer_count_; ++i) {
       char string[32];
       snprintf(string, std::size(string), "present.%d.key", i);
       output_name_strings_.push_back(string);
@@ -134,11 +137,12 @@ Llama_State::Llama_State(Llama_Model& model, std::span<int32_t> sequence_lengths
     output_names_.push_back(output_name.c_str());
 }
 
-std::span<ScoreType> Llama_State::Run(int current_length, std::span<const int32_t> next_tokens) {
+std::span<ScoreType> Llama_State::Run(int current_length, std::span<const int32_t> next_tokens, std::span<const int32_t> next_indices) {
+  bool first_run = first_run_;
   if (first_run_)
     first_run_ = false;
   else
-    UpdateInputs(next_tokens, current_length);
+    UpdateInputs(next_tokens, next_indices, current_length);
 
 #if 0
     printf("**Inputs:\r\n");
@@ -147,79 +151,270 @@ std::span<ScoreType> Llama_State::Run(int current_length, std::span<const int32_
     DumpTensors(outputs_.data(), output_names_.data(), output_names_.size(), false);
 #endif
 
+  if (first_run && model_->logits_uses_seq_len_ && search_params_.sequence_length > 1)
+    RunPrefill();
+  else
+    RunSession();
+
+  if (first_run && search_params_.RowsPerPrompt() > 1)
+    BroadcastPrefill();
+
+  return logits_;
+}
+
+void Llama_State::RunSession(size_t first_output) {
   try {
-    model_->session_decoder_->Run(nullptr, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data(), outputs_.data(), output_names_.size());
+    model_->session_decoder_->Run(nullptr, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data() + first_output, outputs_.data() + first_output, output_names_.size() - first_output);
   }
   catch (const Ort::Exception &e) {
     std::cout << e.what() << std::endl;
   }
+}
 
-  auto type_shape = logits_->GetTensorTypeAndShapeInfo();
-  auto shape = type_shape->GetShape();
-  assert(type_shape->GetShape().size() == 3);
+// With logits for every position, the prompt is run without its last token first and no logits are fetched. The last
+// token is then run on its own with the rest as its past, its logits going straight into logits_. So the prefill logits
+// are (batch_size, 1, vocab_size) whatever the prompt length.
+void Llama_State::RunPrefill() {
+  int64_t batch_size = search_params_.batch_size;
+  int64_t sequence_length = search_params_.sequence_length;
+  int64_t length = sequence_length - 1;
+
+  // Each row's last token goes in the next token inputs, the rest of the prompt is repacked in place without it
+  int64_t* input_ids = input_ids_->GetTensorMutableData<int64_t>();
+  int64_t* position_ids = position_ids_->GetTensorMutableData<int64_t>();
+  for (int64_t i = 0; i < batch_size; i++) {
+    next_input_ids_[i] = input_ids[i * sequence_length + length];
+    next_positions_[i] = position_ids[i * sequence_length + length];
+  }
+  TruncateRows(input_ids, batch_size, sequence_length, length);
+  TruncateRows(position_ids, batch_size, sequence_length, length);
+  TruncateRows(attention_mask_.data(), batch_size, sequence_length, length);
+
+  int64_t shape[] = {batch_size, length};
+  auto prompt_input_ids = OrtValue::CreateTensor<int64_t>(memory_info_, input_ids, batch_size * length, shape, std::size(shape));
+  auto prompt_position_ids = OrtValue::CreateTensor<int64_t>(memory_info_, position_ids, batch_size * length, shape, std::size(shape));
+  expanded_attention_mask_ = OrtValue::CreateTensor<int64_t>(memory_info_, attention_mask_.data(), batch_size * length, shape, std::size(shape));
+  inputs_[0] = prompt_input_ids.get();
+  inputs_[1] = prompt_position_ids.get();
+  inputs_[2] = expanded_attention_mask_.get();
+
+  int64_t present_shape[] = {batch_size, model_->head_count_, length, model_->hidden_size_};
+  size_t present_count = static_cast<size_t>(batch_size) * model_->head_count_ * length * model_->hidden_size_;
+  for (size_t i = 0; i < model_->layer_count_ * 2; i++) {
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape, std::size(present_shape));
+    outputs_[i + 1] = presents_[i].get();
+  }
+  RunSession(1);
+
+  // The last token, the mask growing back to the whole prompt
+  int64_t token_shape[] = {batch_size, 1};
+  auto token_input_ids = OrtValue::CreateTensor<int64_t>(memory_info_, next_input_ids_.data(), batch_size, token_shape, std::size(token_shape));
+  auto token_position_ids = OrtValue::CreateTensor<int64_t>(memory_info_, next_positions_.data(), batch_size, token_shape, std::size(token_shape));
+  inputs_[0] = token_input_ids.get();
+  inputs_[1] = token_position_ids.get();
+
+  GrowMaskRows(attention_mask_.data(), batch_size, length, 1);
+  for (int64_t i = 0; i < batch_size; i++) {
+    if (next_input_ids_[i] == search_params_.pad_token_id)
+      attention_mask_[i * sequence_length + length] = 0;
+  }
+  int64_t mask_shape[] = {batch_size, sequence_length};
+  expanded_attention_mask_ = OrtValue::CreateTensor<int64_t>(memory_info_, attention_mask_.data(), batch_size * sequence_length, mask_shape, std::size(mask_shape));
+  inputs_[2] = expanded_attention_mask_.get();
 
-  return {logits_->GetTensorMutableData<ScoreType>(), type_shape->GetElementCount()};
+  present_shape[2] = sequence_length;
+  present_count = static_cast<size_t>(batch_size) * model_->head_count_ * sequence_length * model_->hidden_size_;
+  for (size_t i = 0; i < model_->layer_count_ * 2; i++) {
+    std::swap(past_buffers_[i], present_buffers_[i]);
+    pasts_[i] = std::move(presents_[i]);
+    inputs_[i + 3] = pasts_[i].get();
+
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape, std::size(present_shape));
+    outputs_[i + 1] = presents_[i].get();
+  }
+  RunSession();
+
+  // Every run after this one sets the token inputs again
+  inputs_[0] = next_input_ids_tensor_.get();
+  inputs_[1] = next_positions_tensor_.get();
 }
 
-void Llama_State::UpdateInputs(std::span<const int32_t> next_tokens, int current_length) {
-  assert(search_params_.num_beams==1);
-  auto& allocator = Ort::Allocator::GetWithDefaultOptions();
+// Copy the prefill's mask, presents and last position logits of each batch row to every beam of the row. Returned
+// sequences get their copy of the prompt's prefill the same way.
+void Llama_State::BroadcastPrefill() {
+  int64_t batch_size = search_params_.batch_size;
+  int64_t batch_beam_size = search_params_.BatchBeamSize();
+  int num_beams = search_params_.RowsPerPrompt();
+  int64_t sequence_length = search_params_.sequence_length;
 
-  // The following updates inputs for subgraph
+  BroadcastRows(attention_mask_.data(), batch_size, num_beams, sequence_length);
+
+  int64_t present_shape[] = {batch_beam_size, model_->head_count_, sequence_length, model_->hidden_size_};
+  size_t block_size = static_cast<size_t>(model_->head_count_) * sequence_length * model_->hidden_size_;
+  for (size_t i = 0; i < model_->layer_count_ * 2; i++) {
+    BroadcastRows(present_buffers_[i].get(), batch_size, num_beams, block_size);
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), batch_beam_size * block_size, present_shape, std::size(present_shape));
+    outputs_[i + 1] = presents_[i].get();
+  }
+
+  BroadcastRows(logits_.data(), batch_size, num_beams, model_->vocab_size_);
+  int64_t logits_shape[] = {batch_beam_size, 1, model_->vocab_size_};
+  logits_tensor_ = OrtValue::CreateTensor<ScoreType>(memory_info_, logits_.data(), logits_.size(), logits_shape, std::size(logits_shape));
+  outputs_[0] = logits_tensor_.get();
+}
+
+std::span<ScoreType> Llama_State::RunTokens(std::span<const int32_t> tokens, int token_count) {
+  assert(search_params_.num_beams == 1 && !first_run_ && model_->logits_uses_seq_len_);
+  auto present_shape = presents_[0]->GetTensorTypeAndShapeInfo()->GetShape();
+  int64_t batch_size = present_shape[0];
+  int64_t past_length = present_shape[2];
+  int64_t length = past_length + token_count;
+  size_t count = batch_size * token_count;
+  assert(tokens.size() == count && length <= search_params_.max_length);
+
+  if (tokens_input_ids_.size() < count) {
+    tokens_input_ids_ = Allocate<int64_t>(allocator_, count, tokens_input_ids_buffer_);
+    tokens_position_ids_ = Allocate<int64_t>(allocator_, count, tokens_position_ids_buffer_);
+    tokens_logits_ = Allocate<ScoreType>(allocator_, count * model_->vocab_size_, tokens_logits_buffer_);
+  }
+
+  // Positions follow on from the past, the same as a single token's in UpdateInputs
+  for (int64_t i = 0; i < batch_size; i++) {
+    for (int j = 0; j < token_count; j++) {
+      tokens_input_ids_[i * token_count + j] = tokens[i * token_count + j];
+      tokens_position_ids_[i * token_count + j] = past_length + j - pad_counts_[i];
+    }
+  }
+
+  int64_t tokens_shape[] = {batch_size, token_count};
+  tokens_input_ids_tensor_ = OrtValue::CreateTensor<int64_t>(memory_info_, tokens_input_ids_.data(), count, tokens_shape, std::size(tokens_shape));
+  tokens_position_ids_tensor_ = OrtValue::CreateTensor<int64_t>(memory_info_, tokens_position_ids_.data(), count, tokens_shape, std::size(tokens_shape));
+  inputs_[0] = tokens_input_ids_tensor_.get();
+  inputs_[1] = tokens_position_ids_tensor_.get();
+
+  // Each mask row grows by token_count
+  int64_t* mask_data = attention_mask_.data();
+  GrowMaskRows(mask_data, batch_size, past_length, token_count);
+  int64_t mask_dims[] = {batch_size, length};
+  expanded_attention_mask_ = OrtValue::CreateTensor<int64_t>(memory_info_, mask_data, batch_size * length, mask_dims, std::size(mask_dims));
+  inputs_[2] = expanded_attention_mask_.get();
+
+  // The logits output goes back to what it was for the next Run
+  OrtValue* logits_output = outputs_[0];
+  int64_t logits_shape[] = {batch_size, token_count, model_->vocab_size_};
+  tokens_logits_tensor_ = OrtValue::CreateTensor<ScoreType>(memory_info_, tokens_logits_.data(), count * model_->vocab_size_, logits_shape, std::size(logits_shape));
+  outputs_[0] = tokens_logits_tensor_.get();
+
+  present_shape[2] = length;
+  size_t present_count = static_cast<size_t>(batch_size) * model_->head_count_ * length * model_->hidden_size_;
+  for (size_t i = 0; i < model_->layer_count_ * 2; i++) {
+    std::swap(past_buffers_[i], present_buffers_[i]);
+    pasts_[i] = std::move(presents_[i]);
+    inputs_[i + 3] = pasts_[i].get();
+
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape.data(), present_shape.size());
+    outputs_[i + 1] = presents_[i].get();
+  }
+
+  try {
+    model_->session_decoder_->Run(nullptr, input_names_.data(), inputs_.data(), input_names_.size(), output_names_.data(), outputs_.data(), output_names_.size());
+  } catch (const Ort::Exception& e) {
+    std::cout << e.what() << std::endl;
+  }
+
+  outputs_[0] = logits_output;
+  return tokens_logits_.subspan(0, count * model_->vocab_size_);
+}
+
+void Llama_State::Truncate(int length) {
+  assert(!first_run_);
+  auto present_shape = presents_[0]->GetTensorTypeAndShapeInfo()->GetShape();
+  int64_t batch_beam_size = present_shape[0];
+  int64_t past_length = present_shape[2];
+  assert(length <= past_length);
+  if (length == past_length)
+    return;
+
+  // The mask rows and the (batch_beam_size, head_count) blocks of each key and value are repacked at the shorter length
+  TruncateRows(attention_mask_.data(), batch_beam_size, past_length, length);
+
+  present_shape[2] = length;
+  int64_t block_count = batch_beam_size * model_->head_count_;
+  size_t hidden_size = model_->hidden_size_;
+  for (size_t i = 0; i < model_->layer_count_ * 2; i++) {
+    ScoreType* present = present_buffers_[i].get();
+    TruncateRows(present, block_count, past_length * hidden_size, length * hidden_size);
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present, block_count * length * hidden_size, present_shape.data(), present_shape.size());
+    outputs_[i + 1] = presents_[i].get();
+  }
+}
+
+void Llama_State::UpdateInputs(std::span<const int32_t> next_tokens, std::span<const int32_t> beam_indices, int current_length) {
+  assert(search_params_.num_beams == 1 || !beam_indices.empty());  // We require beam_indices if we're a beam search
+  assert(next_tokens.size() == search_params_.BatchBeamSize());  // The batch doesn't shrink, so no beam pruning
+
+  // The following updates inputs for subgraph, every buffer was allocated up front so none is allocated here. The mask
+  // and past/present tensors are still new views every step as their shapes grow, ORT allocates those small OrtValues.
 
   // Update input_ids with next tokens.
   int batch_beam_size = static_cast<int>(next_tokens.size());
-  int64_t dims[] = {batch_beam_size, 1};
-  std::unique_ptr<OrtValue> input_ids = OrtValue::CreateTensor<int64_t>(allocator, dims, std::size(dims));
-  int64_t* input_ids_data = input_ids->GetTensorMutableData<int64_t>();
   for (int i = 0; i < batch_beam_size; i++) {
-    input_ids_data[i] = next_tokens[i];
+    next_input_ids_[i] = next_tokens[i];
   }
-  expanded_input_ids_=std::move(input_ids);
-  inputs_[0] = expanded_input_ids_.get();
+  inputs_[0] = next_input_ids_tensor_.get();
 
-  // Update position IDs
+  // Update position IDs, the position of each row's new token is its past length less the padding in its prompt
   inputs_[1] = next_positions_tensor_.get();
   {
     int64_t* position_data = next_positions_.data();
     for (int i = 0; i < batch_beam_size; i++) {
-      position_data[i]=current_length-1;
+      position_data[i] = current_length - 1 - pad_counts_[i];
     }
   }
 
-  // Update attention mask
-  const int64_t* old_mask_data = expanded_attention_mask_->GetTensorMutableData<int64_t>();
+  // Update attention mask, each row grows by one
+  int64_t* mask_data = attention_mask_.data();
+  GrowMaskRows(mask_data, batch_beam_size, current_length - 1, 1);
   int64_t mask_dims[] = {batch_beam_size, current_length};
-  auto attention_mask = OrtValue::CreateTensor<int64_t>(allocator, mask_dims, std::size(mask_dims));
-  int64_t* mask_data = attention_mask->GetTensorMutableData<int64_t>();
-  for (int i = 0; i < batch_beam_size; i++) {
-    for (int j = 0; j < current_length - 1; j++) {
-      mask_data[i * current_length + j] = old_mask_data[i * (current_length - 1) + j];
-    }
-    mask_data[i * current_length + current_length - 1] = 1;
-  }
-  expanded_attention_mask_=std::move(attention_mask);
+  expanded_attention_mask_ = OrtValue::CreateTensor<int64_t>(memory_info_, mask_data, batch_beam_size * current_length, mask_dims, std::size(mask_dims));
   inputs_[2]=expanded_attention_mask_.get();
 
-  // Update logits
-  if (model_->logits_uses_seq_len_)
-  {
-    int64_t logits_shape[] = {search_params_.batch_size * search_params_.num_beams, 1, model_->vocab_size_};
-    logits_ = OrtValue::CreateTensor(allocator, logits_shape, std::size(logits_shape), Ort::TypeToTensorType<ScoreType>::type);
-    outputs_[0]=logits_.get();
-  }
-
-  // feed present_* output to past_* inputs one by one
+  // feed present_* output to past_* inputs one by one. When every beam continues from itself (always for greedy search)
+  // the present buffers become the past buffers as they are, otherwise the beams' rows are gathered into the past buffers.
   int64_t present_shape[] = {batch_beam_size, model_->head_count_, current_length, model_->hidden_size_};
+  size_t present_count = static_cast<size_t>(batch_beam_size) * model_->head_count_ * current_length * model_->hidden_size_;
+
+  bool reorder = false;
+  for (size_t i = 0; i < beam_indices.size(); i++)
+    reorder |= beam_indices[i] != static_cast<int32_t>(i);
 
   for (size_t i = 0; i < model_->layer_count_ * 2; i++) {
-    pasts_[i]=std::move(presents_[i]);
-    inputs_[i + 3] = pasts_[i].get();
+    if (reorder)
+      PickPastState(i, beam_indices, current_length - 1);
+    else {
+      std::swap(past_buffers_[i], present_buffers_[i]);
+      pasts_[i] = std::move(presents_[i]);
+      inputs_[i + 3] = pasts_[i].get();
+    }
 
-    presents_[i] = OrtValue::CreateTensor<float>(allocator, present_shape, std::size(present_shape));
+    presents_[i] = OrtValue::CreateTensor<ScoreType>(memory_info_, present_buffers_[i].get(), present_count, present_shape, std::size(present_shape));
     outputs_[i + 1] = presents_[i].get();
   }
+}
+
+// Copy each beam's row of the present state to the past state. The key and value of a layer are separate tensors of
+// shape (batch_size * num_beams, head_count, past_length, hidden_size), so a row is one contiguous block.
+void Llama_State::PickPastState(size_t index, std::span<const int32_t> beam_indices, int past_length) {
+  int64_t past_shape[] = {static_cast<int64_t>(beam_indices.size()), model_->head_count_, past_length, model_->hidden_size_};
+  size_t block_size = static_cast<size_t>(model_->head_count_) * past_length * model_->hidden_size_;
+
+  ScoreType* past = past_buffers_[index].get();
+  const ScoreType* present = present_buffers_[index].get();
+  for (size_t j = 0; j < beam_indices.size(); j++)
+    memcpy(past + j * block_size, present + beam_indices[j] * block_size, sizeof(ScoreType) * block_size);
 
+  pasts_[index] = OrtValue::CreateTensor<ScoreType>(memory_info_, past, beam_indices.size() * block_size, past_shape, std::size(past_shape));
+  inputs_[index + 3] = pasts_[index].get();
 }
 
 } // Generators
\ No newline at end of file
@@ -5,26 +5,52 @@ namespace Generators {
 
 struct Llama_State {
 
-  Llama_State(Llama_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& params);
-  std::span<ScoreType> Run(int current_length, std::span<const int32_t> next_tokens);
+  Llama_State(const Llama_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& params);
+  std::span<ScoreType> Run(int current_length, std::span<const int32_t> next_tokens, std::span<const int32_t> next_indices = {});
+
+  // The same as Gpt_State's: run 'token_count' tokens per row at once after the past state, returning the logits of all
+  // of them, shape (batch_size, token_count, vocab_size). No beams, and the model needs logits for every position.
+  std::span<ScoreType> RunTokens(std::span<const int32_t> tokens, int token_count);
+
+  // Drop the end of the past state so 'length' positions are left. The next Run's current_length is then length + 1.
+  void Truncate(int length);
+  int GetPastLength() const { return static_cast<int>(presents_[0]->GetTensorTypeAndShapeInfo()->GetShape()[2]); }
 
 private:
-  void UpdateInputs(std::span<const int32_t> next_tokens, int current_length);
+  void UpdateInputs(std::span<const int32_t> next_tokens, std::span<const int32_t> beam_indices, int current_length);
+  void RunSession(size_t first_output = 0);
+  void RunPrefill();
+  void BroadcastPrefill();
+  void PickPastState(size_t index, std::span<const int32_t> beam_indices, int past_length);
 
   SearchParams search_params_;
   bool first_run_{true};
 
+  // Model
+  const Llama_Model* model_;
+  OrtAllocator& allocator_;
+  const OrtMemoryInfo& memory_info_;
+
   std::span<int64_t> next_positions_;  // shape (batch_size, num_beams). Next position value for position_ids.
   Ort::IAllocatorUniquePtr<int64_t> next_positions_buffer_;
   std::unique_ptr<OrtValue> next_positions_tensor_; // Tensor of the 'next_position_' buffer
 
-  // Model
-  Llama_Model* model_;
+  // Padding tokens in each row's prompt. The prompt's position ids skip them, so a row's next position is its past length
+  // less its padding. The rows of a prompt all have its padding, so picking beams doesn't change them.
+  std::span<int32_t> pad_counts_;  // shape (batch_size * num_beams)
+  Ort::IAllocatorUniquePtr<int32_t> pad_counts_buffer_;
+
+  std::span<int64_t> next_input_ids_;  // shape (batch_size * num_beams, 1). Input ids for every run after the first.
+  Ort::IAllocatorUniquePtr<int64_t> next_input_ids_buffer_;
+  std::unique_ptr<OrtValue> next_input_ids_tensor_;
+
+  // Allocated at max_length capacity, the rows are kept packed for the current length and grown in place every run
+  std::span<int64_t> attention_mask_;  // shape (batch_size * num_beams, current_length)
+  Ort::IAllocatorUniquePtr<int64_t> attention_mask_buffer_;
 
   // Inputs
-  std::unique_ptr<OrtValue> input_ids_, expanded_input_ids_;
-  std::unique_ptr<OrtValue> position_ids_, expanded_position_ids_;
-  std::unique_ptr<OrtValue> attention_mask_, expanded_attention_mask_;
+  std::unique_ptr<OrtValue> input_ids_, position_ids_;  // shape (batch_size, sequence_length), the prefill runs once per batch row
+  std::unique_ptr<OrtValue> expanded_attention_mask_;
   std::unique_ptr<OrtValue> empty_past_;
   std::vector<std::unique_ptr<OrtValue>> pasts_;
 
@@ -33,11 +59,24 @@ private:
   std::vector<OrtValue*> inputs_;
 
   // Outputs
-  std::unique_ptr<OrtValue> logits_;
+  std::span<ScoreType> logits_;  // shape (batch_size * num_beams, 1, vocab_size)
+  Ort::IAllocatorUniquePtr<ScoreType> logits_buffer_;
+  std::unique_ptr<OrtValue> logits_tensor_;
   std::vector<std::unique_ptr<OrtValue>> presents_;
   std::vector<std::string> output_name_strings_;
   std::vector<const char*> output_names_;
   std::vector<OrtValue*> outputs_;
+
+  // Only allocated by RunTokens, grown as needed
+  std::span<int64_t> tokens_input_ids_, tokens_position_ids_;  // shape (batch_size, token_count)
+  Ort::IAllocatorUniquePtr<int64_t> tokens_input_ids_buffer_, tokens_position_ids_buffer_;
+  std::span<ScoreType> tokens_logits_;  // shape (batch_size, token_count, vocab_size)
+  Ort::IAllocatorUniquePtr<ScoreType> tokens_logits_buffer_;
+  std::unique_ptr<OrtValue> tokens_input_ids_tensor_, tokens_position_ids_tensor_, tokens_logits_tensor_;
+
+  // Two buffers per key and value of each layer, of shape (batch_size * num_beams, head_count, max_length, hidden_size).
+  // The pasts_ and presents_ tensors are views of the current length into them, after every run the present becomes the past.
+  std::vector<Ort::IAllocatorUniquePtr<ScoreType>> past_buffers_, present_buffers_;
 };
 
 }
\ No newline at end of file
@@ -7,7 +7,7 @@
 
 namespace Generators {
 
-Llama_Cuda::Llama_Cuda(Llama_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& search_params)
+Llama_Cuda::Llama_Cuda(const Llama_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& search_params)
     : model_{&model},
       allocator_cpu_{Ort::Allocator::GetWithDefaultOptions()},
       search_params_{search_params} {
@@ -58,6 +58,13 @@ Llama_Cuda::Llama_Cuda(Llama_Model& model, std::span<int32_t> sequence_lengths,
   cuda::LaunchGpt_InitAttentionMask(attn_mask_value ? nullptr : mask_data, position_data, sequence_lengths_cuda.get(), input_ids_data, search_params_.batch_size, search_params_.num_beams, search_params_.sequence_length, search_params_.pad_token_id, model_->cuda_stream_);
   cudaMemcpy(sequence_lengths.data(), sequence_lengths_cuda.get(), sequence_lengths.size_bytes(), cudaMemcpyDeviceToHost);
 
+  // The positions of a row's new tokens count from its first non pad token, the same as its prompt's do
+  std::vector<int32_t> pad_counts(sequence_lengths.size());
+  for (size_t i = 0; i < pad_counts.size(); i++)
+    pad_counts[i] = search_params_.sequence_length - sequence_lengths[i];
+  pad_counts_buffer_ = CudaMallocArray<int32_t>(pad_counts.size(), &pad_counts_);
+  cudaMemcpy(pad_counts_.data(), pad_counts.data(), pad_counts_.size_bytes(), cudaMemcpyHostToDevice);
+
   assert(search_params_.num_beams == 1);
   expanded_input_ids_ = std::move(input_ids_);
   expanded_position_ids_ = std::move(position_ids_);
@@ -171,9 +178,9 @@ void Llama_Cuda::UpdateInputs(std::span<const int32_t> next_tokens, int current_
   expanded_input_ids_ = std::move(input_ids);
   inputs_[0] = expanded_input_ids_.get();
 
-  // Update position IDs
+  // Update position IDs, the position of each row's new token is its past length less the padding in its prompt
   inputs_[1] = next_positions_tensor_.get();
-  cuda::LaunchGpt_UpdatePositionIds(next_positions_.data(), batch_beam_size, current_length, model_->cuda_stream_);
+  cuda::LaunchGpt_UpdatePositionIds(next_positions_.data(), pad_counts_.data(), batch_beam_size, current_length, model_->cuda_stream_);
 
   // Update attention mask
   const int64_t* old_mask_data = expanded_attention_mask_->GetTensorMutableData<int64_t>();
@@ -5,7 +5,7 @@ namespace Generators {
 
 struct Llama_Cuda {
 
-  Llama_Cuda(Llama_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& params);
+  Llama_Cuda(const Llama_Model& model, std::span<int32_t> sequence_lengths, const SearchParams& params);
   std::span<ScoreType> Run(int current_length, std::span<const int32_t> next_tokens);
 
 private:
@@ -19,7 +19,7 @@ private:
   std::unique_ptr<Ort::Allocator> allocator_cuda_;
 
   // Model
-  Llama_Model* model_;
+  const Llama_Model* model_;
 
   bool past_present_share_buffer_{};  // NYI
 
@@ -27,6 +27,9 @@ private:
   Ort::IAllocatorUniquePtr<int64_t> next_positions_buffer_;
   std::unique_ptr<OrtValue> next_positions_tensor_; // Tensor of the 'next_position_' buffer
 
+  std::span<int32_t> pad_counts_;  // shape (batch_size, num_beams). Pad tokens in each row's prompt, on the device.
+  cuda_unique_ptr<int32_t> pad_counts_buffer_;
+
   // Sessions
   std::unique_ptr<OrtSession> session_decode_;
 
@@ -53,7 +56,7 @@ namespace cuda {
 
 void LaunchGpt_InitAttentionMask(int64_t* mask_data, int64_t* position_data, int32_t* sequence_lengths, const int64_t* input_ids,
                                  int batch_size, int num_beams, int sequence_length, int pad_token_id, cudaStream_t stream);
-void LaunchGpt_UpdatePositionIds(int64_t* positions, int batch_beam_size, int current_length, cudaStream_t stream);
+void LaunchGpt_UpdatePositionIds(int64_t* positions, const int32_t* pad_counts, int batch_beam_size, int current_length, cudaStream_t stream);
 void LaunchGpt_UpdateMask(int64_t* mask_data, const int64_t* old_mask_data, int batch_beam_size, int current_length, cudaStream_t stream);
 
 }
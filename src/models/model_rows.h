@@ -0,0 +1,41 @@
+#pragma once
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <cstring>
+
+namespace Generators {
+
+// Helpers for the row major buffers of the model states (attention masks, past key/value blocks, logits), shared by the
+// Gpt and Llama states.
+
+// Expand 'rows' rows of 'row_size' elements into 'rows * count' rows, every row repeated 'count' times. Rows only move
+// forward, so going from the last to the first moves a row before anything is written over it.
+template <typename T>
+void BroadcastRows(T* data, int64_t rows, int count, size_t row_size) {
+  for (int64_t i = rows - 1; i >= 0; i--) {
+    for (int j = count - 1; j >= 0; j--)
+      memmove(data + (i * count + j) * row_size, data + i * row_size, sizeof(T) * row_size);
+  }
+}
+
+// Grow the 'rows' attention mask rows of 'length' by 'count' positions, all attended (mask 1). Rows only move forward,
+// so going from the last to the first moves a row before the row in front of it grows into its old location.
+template <typename T>
+void GrowMaskRows(T* mask, int64_t rows, size_t length, size_t count) {
+  for (int64_t i = rows - 1; i >= 0; i--) {
+    memmove(mask + i * (length + count), mask + i * length, sizeof(T) * length);
+    std::fill_n(mask + i * (length + count) + length, count, T{1});
+  }
+}
+
+// Repack 'rows' rows of 'row_size' elements with only their first 'new_row_size' elements. Everything moves to an
+// earlier place, so going from the first to the last never overwrites anything that hasn't moved.
+template <typename T>
+void TruncateRows(T* data, int64_t rows, size_t row_size, size_t new_row_size) {
+  assert(new_row_size <= row_size);
+  for (int64_t i = 0; i < rows; i++)
+    memmove(data + i * new_row_size, data + i * row_size, sizeof(T) * new_row_size);
+}
+
+}  // namespace Generators
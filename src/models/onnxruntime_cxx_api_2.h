@@ -1029,6 +1029,17 @@ struct OrtArenaCfg {
   Ort::Abstract make_abstract;
 };
 
+/*! \struct OrtPrepackedWeightsContainer
+ * \brief Prepacked weights shared by the sessions created with it
+ * \details Sessions of the same model created with one container keep a single copy of the prepacked weights
+ */
+struct OrtPrepackedWeightsContainer {
+  static std::unique_ptr<OrtPrepackedWeightsContainer> Create();  ///< Wraps OrtApi::CreatePrepackedWeightsContainer
+
+  static void operator delete(void* p) { Ort::api->ReleasePrepackedWeightsContainer(reinterpret_cast<OrtPrepackedWeightsContainer*>(p)); }
+  Ort::Abstract make_abstract;
+};
+
 //
 // Custom OPs (only needed to implement custom OPs)
 //
@@ -273,6 +273,12 @@ inline std::unique_ptr<OrtArenaCfg> OrtArenaCfg::Create(size_t max_mem, int aren
   return std::unique_ptr<OrtArenaCfg>{p};
 }
 
+inline std::unique_ptr<OrtPrepackedWeightsContainer> OrtPrepackedWeightsContainer::Create() {
+  OrtPrepackedWeightsContainer* p;
+  Ort::ThrowOnError(Ort::api->CreatePrepackedWeightsContainer(&p));
+  return std::unique_ptr<OrtPrepackedWeightsContainer>{p};
+}
+
 inline void OrtCommonEnvInit(OrtEnv& v, _In_ const char* logid)
 {
   if (strcmp(logid, "onnxruntime-node") == 0) {
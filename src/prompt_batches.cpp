@@ -0,0 +1,80 @@
+#include "generators.h"
+#include "prompt_batches.h"
+
+namespace Generators {
+
+void PromptBatch::SetParams(SearchParams& params) const {
+  params.batch_size = static_cast<int>(prompt_indices.size());
+  params.sequence_length = sequence_length;
+  params.input_ids = std::span<const int32_t>(input_ids.data(), input_ids.size());
+}
+
+std::vector<PromptBatch> MakePromptBatches(std::span<const std::span<const int32_t>> prompts, int32_t pad_token_id,
+                                           int max_batch_size, float max_padding_fraction) {
+  assert(max_batch_size > 0);
+
+  // Each prompt without its leading padding
+  std::vector<std::span<const int32_t>> trimmed;
+  for (size_t i = 0; i < prompts.size(); i++) {
+    auto prompt = prompts[i];
+    size_t pad_length = std::find_if(prompt.data(), prompt.data() + prompt.size(), [pad_token_id](int32_t token) { return token != pad_token_id; }) - prompt.data();
+    assert(pad_length < prompt.size());  // Every prompt needs a token
+    trimmed.push_back(prompt.subspan(pad_length, prompt.size() - pad_length));
+  }
+
+  std::vector<size_t> order(prompts.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&trimmed](size_t a, size_t b) { return trimmed[a].size() < trimmed[b].size(); });
+
+  // The prompts go in shortest first, so the last one added sets the batch's length
+  std::vector<PromptBatch> batches;
+  size_t batch_start = 0;
+  size_t token_count = 0;  // Non pad tokens in the batch
+  auto make_batch = [&](size_t batch_end) {
+    auto& batch = batches.emplace_back();
+    batch.sequence_length = static_cast<int>(trimmed[order[batch_end - 1]].size());
+    for (size_t i = batch_start; i < batch_end; i++) {
+      auto prompt = trimmed[order[i]];
+      int pad_length = batch.sequence_length - static_cast<int>(prompt.size());
+      batch.prompt_indices.push_back(order[i]);
+      batch.input_ids.insert(batch.input_ids.end(), pad_length, pad_token_id);
+      batch.input_ids.insert(batch.input_ids.end(), prompt.data(), prompt.data() + prompt.size());
+    }
+  };
+
+  for (size_t i = 0; i < order.size(); i++) {
+    size_t length = trimmed[order[i]].size();
+    size_t row_count = i - batch_start + 1;
+    size_t padding = row_count * length - (token_count + length);
+    if (i > batch_start && (row_count > static_cast<size_t>(max_batch_size) || padding > max_padding_fraction * row_count * length)) {
+      make_batch(i);
+      batch_start = i;
+      token_count = 0;
+    }
+    token_count += length;
+  }
+  if (batch_start < order.size())
+    make_batch(order.size());
+
+  return batches;
+}
+
+int TrimCommonPadding(std::span<int32_t> input_ids, int batch_size, int sequence_length, int32_t pad_token_id) {
+  // The rows are left padded, so the shortest padding is the number of columns that are padding in every row
+  int trim_length = sequence_length;
+  for (int i = 0; i < batch_size && trim_length > 0; i++) {
+    const int32_t* row = input_ids.data() + i * sequence_length;
+    trim_length = static_cast<int>(std::find_if(row, row + trim_length, [pad_token_id](int32_t token) { return token != pad_token_id; }) - row);
+  }
+
+  int trimmed_length = sequence_length - trim_length;
+  if (trim_length == 0 || trimmed_length == 0)
+    return sequence_length;
+
+  // Rows only move to earlier positions, so going from the first to the last never overwrites a row before it's moved
+  for (int i = 0; i < batch_size; i++)
+    memmove(input_ids.data() + i * trimmed_length, input_ids.data() + i * sequence_length + trim_length, sizeof(int32_t) * trimmed_length);
+  return trimmed_length;
+}
+
+}  // namespace Generators
@@ -0,0 +1,28 @@
+#pragma once
+
+namespace Generators {
+
+// Prompts batched together for a model state, left padded to the longest of them
+struct PromptBatch {
+  std::vector<size_t> prompt_indices;  // Index of each row's prompt in the prompts it was made from
+  std::vector<int32_t> input_ids;      // shape (prompt_indices.size(), sequence_length)
+  int sequence_length{};
+
+  // Point the batch_size, sequence_length and input_ids of 'params' at this batch
+  void SetParams(SearchParams& params) const;
+};
+
+// Groups prompts of similar length so a long prompt doesn't pad out the prefill of a batch of short ones. Any leading pad
+// tokens of the prompts are dropped, then they're sorted by length and cut into batches of at most max_batch_size, a new
+// batch starting early when padding to the next prompt would make more than max_padding_fraction of the batch padding.
+// No column of a batch is padding in every row. Gpt_State and Llama_State count each row's position ids from its first non
+// pad token, in the prefill and in every step after it, and the attention mask excludes the padding, so the rows come out
+// the same as the unbatched prompts.
+std::vector<PromptBatch> MakePromptBatches(std::span<const std::span<const int32_t>> prompts, int32_t pad_token_id,
+                                           int max_batch_size, float max_padding_fraction);
+
+// Removes the leading columns of a left padded batch that are padding in every row, returns the new sequence_length.
+// 'input_ids' of shape (batch_size, sequence_length) is packed in place.
+int TrimCommonPadding(std::span<int32_t> input_ids, int batch_size, int sequence_length, int32_t pad_token_id);
+
+}  // namespace Generators
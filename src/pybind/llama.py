@@ -9,7 +9,7 @@ device_type = og.DeviceType.CPU
 tokenizer = LlamaTokenizer.from_pretrained('meta-llama/Llama-2-7b-hf')
 
 print("Loading model...")
-model=og.Llama_Model("../../test_models/llama2-7b-fp32-cpu/Llama-2-7b-hf_decoder_merged_model_fp32_opt.onnx", device_type)
+model=og.Llama_Model("../../test_models/meta-llama/Llama-2-7b-hf/Llama-2-7b-hf_decoder_merged_model_fp32_opt.onnx", device_type)
 print("Model loaded")
 
 # Keep asking for input prompts in an loop
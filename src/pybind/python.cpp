@@ -401,11 +401,11 @@ struct PyLlama_State {
       cpu_ = std::make_unique<Llama_State>(model, sequence_lengths.GetCPUArray(), search_params);
   }
 
-  RoamingArray<float>& Run(int current_length, RoamingArray<int32_t>& next_tokens) {
+  RoamingArray<float>& Run(int current_length, RoamingArray<int32_t>& next_tokens, RoamingArray<int32_t>& next_indices) {
     if (cuda_)
       py_logits_.SetGPU(cuda_->Run(current_length, next_tokens.GetGPUArray()));
     else
-      py_logits_.SetCPU(cpu_->Run(current_length, next_tokens.GetCPUArray()));
+      py_logits_.SetCPU(cpu_->Run(current_length, next_tokens.GetCPUArray(), next_indices.GetCPUArray()));
 
     return py_logits_;
   }
@@ -511,8 +511,8 @@ PYBIND11_MODULE(ort_generators, m) {
 
   pybind11::class_<PyLlama_State>(m, "Llama_State")
       .def(pybind11::init<Llama_Model&, RoamingArray<int32_t>&, const PySearchParams&>())
-      .def("Run", &PyLlama_State::Run,
-          pybind11::return_value_policy::reference_internal);
+      .def("Run", &PyLlama_State::Run, "current_length"_a, "next_tokens"_a, "next_indices"_a = RoamingArray<int32_t>{},
+           pybind11::return_value_policy::reference_internal);
 
 #ifdef VERSION_INFO
   m.attr("__version__") = MACRO_STRINGIFY(VERSION_INFO);
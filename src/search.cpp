@@ -10,68 +10,218 @@ namespace Generators {
 
 Search::Search(SearchParams params)
     : params_{params},
-      sequences_{params.input_ids, params.batch_size, params.num_beams, params_.max_length} {
+      sequences_{params.input_ids, params.batch_size, params.RowsPerPrompt(), params_.max_length} {
 
   auto batch_beam_size = params.BatchBeamSize();
 
-  sequence_lengths_buffer_ = AllocateArray<int32_t>(batch_beam_size, &sequence_lengths_);
+  // Every returned sequence is a batch row to the search, Sequences has already copied the prompt to them
+  if (params_.num_return_sequences > 1) {
+    assert(params_.num_beams == 1 && !IsGuided());
+    return_sequence_count_ = params_.num_return_sequences;
+    params_.batch_size *= return_sequence_count_;
+    params_.num_return_sequences = 1;
+  }
+
+  sequence_lengths_buffer_ = AllocateArray<int32_t>(IsGuided() ? 2 * batch_beam_size : batch_beam_size, &sequence_lengths_);
+
+  if (IsGuided()) {
+    assert(params_.unconditional_input_ids.size() == params_.input_ids.size());
+    guidance_input_ids_.assign(params_.input_ids.data(), params_.input_ids.data() + params_.input_ids.size());
+    guidance_input_ids_.insert(guidance_input_ids_.end(), params_.unconditional_input_ids.data(), params_.unconditional_input_ids.data() + params_.unconditional_input_ids.size());
+    guidance_scores_ = std::make_unique<ScoreType[]>(params_.vocab_size);
+  }
 
   size_t next_token_size = batch_beam_size * params_.vocab_size;
   next_token_scores_buffer_ = AllocateArray<ScoreType>(next_token_size, &next_token_scores_);
   memset(next_token_scores_.data(), 0, next_token_scores_.size_bytes());
+
+  row_active_buffer_ = AllocateArray<bool>(batch_beam_size, &row_active_);
+  std::fill(row_active_.begin(), row_active_.end(), true);
+
+  model_rows_buffer_ = AllocateArray<int32_t>(batch_beam_size, &model_rows_);
+  std::iota(model_rows_.begin(), model_rows_.end(), 0);
+
+  if (params_.stop_sequences) {
+    stop_states_buffer_ = AllocateArray<int>(batch_beam_size, &stop_states_);
+    std::fill(stop_states_.begin(), stop_states_.end(), 0);
+  }
 }
 
 GreedySearch::GreedySearch(SearchParams params)
     : Search(params) {
-  next_tokens_buffer_ = AllocateArray<int32_t>(params.batch_size, &next_tokens_);
+  next_tokens_buffer_ = AllocateArray<int32_t>(params_.batch_size, &next_tokens_);
   memset(next_tokens_.data(), 0, next_tokens_.size_bytes());
 
-  eos_seen_buffer_ = AllocateArray<bool>(params.batch_size, &eos_seen_);
-  memset(eos_seen_.data(), 0, eos_seen_.size_bytes());
+  model_next_tokens_buffer_ = AllocateArray<int32_t>(params_.batch_size, &model_next_tokens_);
+  kept_rows_buffer_ = AllocateArray<int32_t>(params_.batch_size, &kept_rows_);
+  if (IsGuided())
+    guidance_next_tokens_buffer_ = AllocateArray<int32_t>(2 * params_.batch_size, &guidance_next_tokens_);
+
+  // The rows of a batch entry's returned sequences share its seed, so each gets its own sequence from it
+  std::random_device random_device;
+  for (int i = 0; i < params_.batch_size; i++) {
+    if (params_.seeds.empty())
+      generators_.emplace_back(random_device());
+    else {
+      std::seed_seq seed{params_.seeds[GetBatchIndex(i)], static_cast<uint32_t>(i % return_sequence_count_)};
+      generators_.emplace_back(seed);
+    }
+  }
 }
 
 BeamSearch::BeamSearch(SearchParams params)
     : Search(params) {
   assert(params_.num_beams > 1);  // If 1, use GreedySearch
+  assert(!IsGuided() && params_.max_lengths.empty());
   beam_scorer_ = std::make_unique<BeamSearchScorer>(params_);
+
+  if (IsPruning()) {
+    auto batch_beam_size = params_.BatchBeamSize();
+    model_next_tokens_buffer_ = AllocateArray<int32_t>(batch_beam_size, &model_next_tokens_);
+    model_next_indices_buffer_ = AllocateArray<int32_t>(batch_beam_size, &model_next_indices_);
+    model_row_of_buffer_ = std::make_unique<int32_t[]>(batch_beam_size);
+  }
+
+  if (params_.stop_sequences) {
+    next_stops_buffer_ = AllocateArray<bool>(2 * params_.BatchBeamSize(), &next_stops_);
+    parent_stop_states_buffer_ = AllocateArray<int>(params_.BatchBeamSize(), &parent_stop_states_);
+  }
 }
 
 BeamSearch::~BeamSearch() = default;
 
+SearchParams Search::GetModelParams() const {
+  SearchParams params = params_;
+  if (IsGuided()) {
+    params.batch_size *= 2;
+    params.input_ids = std::span<const int32_t>(guidance_input_ids_.data(), guidance_input_ids_.size());
+    params.unconditional_input_ids = {};
+  }
+  if (return_sequence_count_ > 1) {
+    params.batch_size /= return_sequence_count_;
+    params.num_return_sequences = return_sequence_count_;
+  }
+  return params;
+}
+
 void Search::SetLogits(std::span<const ScoreType> logits) {
   // Logits has shape (batch_size, input_length, vocab_size),
   // where input_length equals to parameters_->sequence_length for first subgraph call, and 1 for the remaining calls.
 
-  auto batch_beam_size = params_.BatchBeamSize();
-  auto input_length = logits.size() / (batch_beam_size * params_.vocab_size);
-  assert(logits.size() % (batch_beam_size * params_.vocab_size) == 0);  // Should divide evenly
+  auto batch_beam_size = static_cast<int>(model_rows_.size());
+  auto model_batch_size = IsGuided() ? 2 * batch_beam_size : batch_beam_size;
+  auto input_length = logits.size() / (model_batch_size * params_.vocab_size);
+  assert(logits.size() % (model_batch_size * params_.vocab_size) == 0);  // Should divide evenly
+
+  // With guidance the unconditional row of row i is row i + batch_beam_size. Both are log softmaxed and combined as
+  // uncond + scale * (cond - uncond), which is then normalized again.
+  if (IsGuided()) {
+    std::span<ScoreType> unconditional(guidance_scores_.get(), params_.vocab_size);
+    for (int i = 0; i < batch_beam_size; i++) {
+      if (!row_active_[i])
+        continue;
+      std::span<ScoreType> target = next_token_scores_.subspan(i * params_.vocab_size, params_.vocab_size);
+      copy(std::span<const ScoreType>(logits.data() + (i * input_length + input_length - 1) * params_.vocab_size, params_.vocab_size), target);
+      copy(std::span<const ScoreType>(logits.data() + ((i + batch_beam_size) * input_length + input_length - 1) * params_.vocab_size, params_.vocab_size), unconditional);
+      log_softmax(target);
+      log_softmax(unconditional);
+      for (int j = 0; j < params_.vocab_size; j++)
+        target[j] = unconditional[j] + params_.guidance_scale * (target[j] - unconditional[j]);
+      log_softmax(target);
+    }
+    return;
+  }
 
-  // TODO: if input_length==1, use token scores directly
+  // The model can write its logits straight into our scores (see Gpt_State::UseIoBinding), then only the softmax is left.
+  // If the model batch was compacted its rows are packed at the start, they only ever move to later rows so going from
+  // the last to the first doesn't overwrite any row before it's moved.
+  if (logits.data() == next_token_scores_.data()) {
+    assert(input_length == 1);
+    for (int i = batch_beam_size - 1; i >= 0; i--) {
+      if (!row_active_[model_rows_[i]])
+        continue;
+      std::span<ScoreType> target = next_token_scores_.subspan(model_rows_[i] * params_.vocab_size, params_.vocab_size);
+      if (model_rows_[i] != i)
+        memcpy(target.data(), next_token_scores_.data() + i * params_.vocab_size, target.size_bytes());
+      log_softmax(target);
+    }
+    return;
+  }
 
   // Get logits for the last token:
   //    next_token_logits = logits[:, -1, :], and the result shape is (batch_size, vocab_size)
   // When input_length == 1, use logits directly in SoftmaxCPU below so it only need for input_length > 1.
-  const ScoreType* current_logits = logits.data() + (input_length - 1) * params_.vocab_size;
   for (int i = 0; i < batch_beam_size; i++) {
-    std::span<const ScoreType> source(current_logits, params_.vocab_size);
-    std::span<ScoreType> target = next_token_scores_.subspan(i * params_.vocab_size, params_.vocab_size);
+    if (!row_active_[model_rows_[i]])
+      continue;
+    std::span<const ScoreType> source(logits.data() + (i * input_length + input_length - 1) * params_.vocab_size, params_.vocab_size);
+    std::span<ScoreType> target = next_token_scores_.subspan(model_rows_[i] * params_.vocab_size, params_.vocab_size);
     copy(source, target);
-    current_logits += input_length * params_.vocab_size;
 
     log_softmax(target);
   }
 }
 
 std::span<int32_t> GreedySearch::GetNextTokens() {
-  return next_tokens_;
+  // Both the conditional and unconditional rows continue with the chosen tokens
+  if (IsGuided()) {
+    copy(std::span<const int32_t>(next_tokens_), guidance_next_tokens_.subspan(0, next_tokens_.size()));
+    copy(std::span<const int32_t>(next_tokens_), guidance_next_tokens_.subspan(next_tokens_.size(), next_tokens_.size()));
+    return guidance_next_tokens_;
+  }
+
+  if (model_rows_.size() == next_tokens_.size())
+    return next_tokens_;
+
+  for (size_t i = 0; i < model_rows_.size(); i++)
+    model_next_tokens_[i] = next_tokens_[model_rows_[i]];
+  return model_next_tokens_.subspan(0, model_rows_.size());
+}
+
+std::span<const int32_t> GreedySearch::CompactFinishedRows() {
+  assert(!IsGuided());
+  size_t kept_count = 0;
+  for (size_t i = 0; i < model_rows_.size(); i++) {
+    if (!row_active_[model_rows_[i]])
+      continue;
+    kept_rows_[kept_count] = static_cast<int32_t>(i);
+    model_rows_[kept_count++] = model_rows_[i];
+  }
+
+  model_rows_ = model_rows_.subspan(0, kept_count);
+  return kept_rows_.subspan(0, kept_count);
 }
 
 std::span<int32_t> BeamSearch::GetNextTokens() {
-  return beam_scorer_->GetNextTokens();
+  if (model_rows_.size() == params_.BatchBeamSize())
+    return beam_scorer_->GetNextTokens();
+  return model_next_tokens_.subspan(0, model_rows_.size());
 }
 
 std::span<int32_t> BeamSearch::GetNextIndices() {
-  return beam_scorer_->GetNextIndicesCPU();
+  if (model_rows_.size() == params_.BatchBeamSize())
+    return beam_scorer_->GetNextIndicesCPU();
+  return model_next_indices_.subspan(0, model_rows_.size());
+}
+
+// Drop the beams that aren't active from the model batch. The parent of every active beam was in the model batch just
+// run, as only active beams have candidates.
+void BeamSearch::CompactBeams() {
+  for (size_t i = 0; i < model_rows_.size(); i++)
+    model_row_of_buffer_[model_rows_[i]] = static_cast<int32_t>(i);
+
+  auto next_tokens = beam_scorer_->GetNextTokens();
+  auto next_indices = beam_scorer_->GetNextIndicesCPU();
+  std::span<int32_t> model_rows(model_rows_buffer_.get(), params_.BatchBeamSize());
+  size_t count = 0;
+  for (int i = 0; i < params_.BatchBeamSize(); i++) {
+    if (!row_active_[i])
+      continue;
+    model_next_tokens_[count] = next_tokens[i];
+    model_next_indices_[count] = model_row_of_buffer_[next_indices[i]];
+    model_rows[count++] = i;
+  }
+  model_rows_ = model_rows.subspan(0, count);
 }
 
 int Search::GetSequenceLength() {
@@ -87,6 +237,10 @@ void BeamSearch::SelectTop() {
   int batch_beam_index = 0;
   for (int i = 0; i < params_.batch_size; i++) {
     for (int j = 0; j < params_.num_beams; j++, batch_beam_index++) {
+      if (!row_active_[batch_beam_index]) {
+        offset += params_.vocab_size;
+        continue;
+      }
       for (int k = 0; k < params_.vocab_size; k++, offset++) {
         next_token_scores_[offset] += beam_scores[batch_beam_index];
       }
@@ -111,11 +265,20 @@ void BeamSearch::SelectTop() {
   auto next_indices = std::span<int32_t>(indices.get(), top_k * params_.batch_size);
   auto next_tokens = std::span<int32_t>(tokens.get(), top_k * params_.batch_size);
 
+  // Candidates that complete a stop sequence are finished hypotheses, the same as EOS
+  std::span<bool> next_stops = next_stops_;
+
   for (int batch_index = 0; batch_index < params_.batch_size; batch_index++) {
+    if (beam_scorer_->IsDone(batch_index))  // The scorer only pads a done batch entry, so it needs no candidates
+      continue;
+
     std::priority_queue<ScoreIndex, std::vector<ScoreIndex>> queue;
     auto token_scores_sub = next_token_scores_.subspan(batch_index * params_.num_beams * params_.vocab_size, params_.num_beams * params_.vocab_size);
-    for (int i = 0; i < token_scores_sub.size(); i++) {
-      queue.push({token_scores_sub[i], i});
+    for (int j = 0; j < params_.num_beams; j++) {
+      if (!row_active_[batch_index * params_.num_beams + j])  // A pruned beam has no candidates
+        continue;
+      for (int i = j * params_.vocab_size; i < (j + 1) * params_.vocab_size; i++)
+        queue.push({token_scores_sub[i], i});
     }
 
     auto next_indices_sub = next_indices.subspan(top_k * batch_index, top_k);
@@ -127,6 +290,11 @@ void BeamSearch::SelectTop() {
       next_tokens_sub[i] = v.index % params_.vocab_size;
       next_scores_sub[i] = v.score;
       queue.pop();
+
+      if (params_.stop_sequences) {
+        int state = params_.stop_sequences->Next(stop_states_[batch_index * params_.num_beams + next_indices_sub[i]], next_tokens_sub[i]);
+        next_stops[top_k * batch_index + i] = params_.stop_sequences->IsMatch(state);
+      }
     }
   }
 
@@ -136,10 +304,25 @@ void BeamSearch::SelectTop() {
   DumpMemory("Next Indices", next_indices);
 #endif
 
-  beam_scorer_->Process(sequences_, next_scores, next_tokens, next_indices);
+  beam_scorer_->Process(sequences_, next_scores, next_tokens, next_indices, next_stops);
   next_tokens_ = beam_scorer_->GetNextTokens();
 
+  // The new beams carry on from their parent's stop sequence state
+  if (params_.stop_sequences) {
+    copy(std::span<const int>(stop_states_), parent_stop_states_);
+    auto beam_indices = beam_scorer_->GetNextIndicesCPU();
+    for (size_t i = 0; i < stop_states_.size(); i++)
+      stop_states_[i] = params_.stop_sequences->Next(parent_stop_states_[beam_indices[i]], next_tokens_[i]);
+  }
+
+  for (int batch_index = 0; batch_index < params_.batch_size; batch_index++) {
+    int active_beams = beam_scorer_->IsDone(batch_index) ? 0 : beam_scorer_->GetActiveBeamCount(batch_index);
+    std::fill_n(&row_active_[batch_index * params_.num_beams + active_beams], params_.num_beams - active_beams, false);
+  }
+
   AppendNextTokensToSequences();
+  if (IsPruning())
+    CompactBeams();
 }
 
 void GreedySearch::SelectTop() {
@@ -156,43 +339,6 @@ void GreedySearch::SelectTop() {
   AppendNextTokensToSequences();
 }
 
-void GreedySearch::SampleTopK(int k, float temperature)
-{
-#if 0
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<float> dis(0, k);
-
-  std::vector<int32_t> top_k;
-  top_k.resize(k);
-  for (size_t batch_id = 0; batch_id < params_.batch_size; batch_id++) {
-    std::span<ScoreType> scores = next_token_scores_.subspan(batch_id * params_.vocab_size, params_.vocab_size);
-
-    // Apply temperature and convert log probabilities to probabilities
-    std::vector<float> prob(scores.size());
-    std::transform(scores.begin(), scores.end(), prob.begin(), [temperature](float logp) { return std::exp(logp / temperature); });
-
-    // Find the top K scores
-    std::vector<int> indices(scores.size());
-    std::iota(indices.begin(), indices.end(), 0);
-    std::partial_sort(indices.begin(), indices.begin() + k, indices.end(), [prob](int i, int j) { return prob[i] > prob[j]; });
-
-    // Normalize the top K probabilities
-    float total = std::accumulate(indices.begin(), indices.begin() + k, 0.0f, [prob](float sum, int i) { return sum + prob[i]; });
-    std::transform(indices.begin(), indices.begin() + k, prob.begin(), [total](int i) { return prob[i] / total; });
-
-    // Sample a token from the top K
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::discrete_distribution<> dis(prob.begin(), prob.begin() + k);
-
-    SetNextToken(batch_id, indices[dis(gen)]);
-  }
-#endif
-
-  AppendNextTokensToSequences();
-}
-
 void SoftMax(std::span<ScoreType> scores, float temperature) {
   ScoreType max_score = *std::max_element(scores.begin(), scores.end());
 
@@ -206,19 +352,50 @@ void SoftMax(std::span<ScoreType> scores, float temperature) {
   std::transform(scores.begin(), scores.end(), scores.begin(), [exp_sum](ScoreType score) { return score / exp_sum; });
 }
 
-void GreedySearch::SampleTopP(float p, float temperature)
+void GreedySearch::SampleTopK(int k, float temperature)
 {
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_real_distribution<float> dis(0, p);
+  std::vector<int32_t> indices(params_.vocab_size);
+  std::vector<ScoreType> top_k_probs;
 
   for (size_t batch_id = 0; batch_id < params_.batch_size; batch_id++) {
     if (PadIfAlreadyEOS(batch_id))
       continue;
 
+    int batch_index = GetBatchIndex(static_cast<int>(batch_id));
+    int row_k = std::min(params_.top_ks.empty() ? k : params_.top_ks[batch_index], params_.vocab_size);
+    float row_temperature = params_.temperatures.empty() ? temperature : params_.temperatures[batch_index];
+
     std::span<ScoreType> scores = next_token_scores_.subspan(batch_id * params_.vocab_size, params_.vocab_size);
+    SoftMax(scores, row_temperature);
 
-    SoftMax(scores, temperature);
+    // Find the top K scores, the distribution normalizes their probabilities
+    std::iota(indices.begin(), indices.end(), 0);
+    std::partial_sort(indices.begin(), indices.begin() + row_k, indices.end(), [scores = scores.data()](int32_t i, int32_t j) { return scores[i] > scores[j]; });
+    top_k_probs.resize(row_k);
+    for (int i = 0; i < row_k; i++)
+      top_k_probs[i] = scores[indices[i]];
+
+    std::discrete_distribution<int32_t> distribution(top_k_probs.begin(), top_k_probs.end());
+    SetNextToken(batch_id, indices[distribution(generators_[batch_id])]);
+  }
+
+  AppendNextTokensToSequences();
+}
+
+void GreedySearch::SampleTopP(float p, float temperature)
+{
+  for (size_t batch_id = 0; batch_id < params_.batch_size; batch_id++) {
+    if (PadIfAlreadyEOS(batch_id))
+      continue;
+
+    int batch_index = GetBatchIndex(static_cast<int>(batch_id));
+    float row_p = params_.top_ps.empty() ? p : params_.top_ps[batch_index];
+    float row_temperature = params_.temperatures.empty() ? temperature : params_.temperatures[batch_index];
+    std::uniform_real_distribution<float> dis(0, row_p);
+
+    std::span<ScoreType> scores = next_token_scores_.subspan(batch_id * params_.vocab_size, params_.vocab_size);
+
+    SoftMax(scores, row_temperature);
 
     // Sort an array of indices into the scores
     std::vector<int32_t> indices(scores.size());
@@ -226,7 +403,7 @@ void GreedySearch::SampleTopP(float p, float temperature)
     std::sort(indices.begin(), indices.end(), [scores = scores.data()](int32_t i, int32_t j) { return scores[i] > scores[j]; });
 
     // Sample a probability threshold
-    float threshold = dis(gen);
+    float threshold = dis(generators_[batch_id]);
 
     int32_t token=0;
     // Find the first token where the cumulative probability exceeds the threshold
@@ -247,7 +424,7 @@ void GreedySearch::SampleTopP(float p, float temperature)
 
 bool GreedySearch::PadIfAlreadyEOS(size_t batch_id) {
    // If this batch entry has already seen the EOS token, append the pad token
-  if (!eos_seen_[batch_id])
+  if (row_active_[batch_id])
     return false;
 
   next_tokens_[batch_id] = params_.pad_token_id;
@@ -257,11 +434,21 @@ bool GreedySearch::PadIfAlreadyEOS(size_t batch_id) {
 
 void GreedySearch::SetNextToken(size_t batch_id, int32_t token) {
   next_tokens_[batch_id] = token;
-  if (token == params_.eos_token_id) {
-    eos_seen_[batch_id] = true;
-    if (--not_done_count_ == 0)
-      done_ = true;
+
+  bool stopped = false;
+  if (params_.stop_sequences) {
+    stop_states_[batch_id] = params_.stop_sequences->Next(stop_states_[batch_id], token);
+    stopped = params_.stop_sequences->IsMatch(stop_states_[batch_id]);
   }
+
+  if (token == params_.eos_token_id || stopped)
+    FinishRow(batch_id);
+}
+
+void GreedySearch::FinishRow(size_t batch_id) {
+  row_active_[batch_id] = false;
+  if (--not_done_count_ == 0)
+    done_ = true;
 }
 
 void GreedySearch::AppendNextTokensToSequences() {
@@ -269,12 +456,23 @@ void GreedySearch::AppendNextTokensToSequences() {
 
   if (sequences_.GetSequenceLength() == params_.max_length)
     done_ = true;
+
+  // A row at its own max length is finished the same as at its EOS, the remaining tokens are padding
+  if (!params_.max_lengths.empty()) {
+    for (size_t batch_id = 0; batch_id < params_.batch_size; batch_id++) {
+      int max_length = params_.max_lengths[GetBatchIndex(static_cast<int>(batch_id))];
+      assert(max_length <= params_.max_length);
+      if (row_active_[batch_id] && sequences_.GetSequenceLength() >= max_length)
+        FinishRow(batch_id);
+    }
+  }
 }
 
 void BeamSearch::AppendNextTokensToSequences() {
   sequences_.AppendNextTokenToSequences(beam_scorer_->GetNextIndicesCPU(), beam_scorer_->GetNextTokens());
 
-  if (sequences_.GetSequenceLength() == params_.max_length)
+  // Once every batch entry is done the remaining steps would only pad, so stop
+  if (sequences_.GetSequenceLength() == params_.max_length || beam_scorer_->IsDone())
     done_ = true;
 }
 
@@ -308,11 +506,17 @@ std::span<ScoreType> Search::GetScores(int batch_beam_index) {
 namespace Processors {
 
 void MinLength(Search& search, int min_length) {
-  if (search.sequences_.GetSequenceLength() >= min_length)
+  auto& min_lengths = search.params_.min_lengths;
+  if (min_lengths.empty() && search.sequences_.GetSequenceLength() >= min_length)
     return;
 
   const int batch_beam_size = search.params_.BatchBeamSize();
   for (int i = 0; i < batch_beam_size; i++) {
+    if (!search.row_active_[i])
+      continue;
+    int row_min_length = min_lengths.empty() ? min_length : min_lengths[search.GetBatchIndex(i)];
+    if (search.sequences_.GetSequenceLength() >= row_min_length)
+      continue;
     std::span<ScoreType> beam_token_scores = search.GetScores(i);
     beam_token_scores[search.params_.eos_token_id] = std::numeric_limits<ScoreType>::lowest();
   }
@@ -321,6 +525,9 @@ void MinLength(Search& search, int min_length) {
 void RepetitionPenalty(Search& search, ScoreType penalty) {
   const int batch_beam_size = search.params_.BatchBeamSize();
   for (int i = 0; i < batch_beam_size; i++) {
+    if (!search.row_active_[i])
+      continue;
+    ScoreType row_penalty = search.params_.repetition_penalties.empty() ? penalty : search.params_.repetition_penalties[search.GetBatchIndex(i)];
     std::span<ScoreType> beam_token_scores = search.GetScores(i);
     std::span<const int32_t> sequence = search.sequences_.GetSequence(i);
 
@@ -335,7 +542,7 @@ void RepetitionPenalty(Search& search, ScoreType penalty) {
 
       // If score < 0, then repetition penalty > 1.0 has to multiplied to reduce the previous token probability,
       // This assumes that scores are either positive (like ctrl) or negative (like GPT-2), but not a mixture.
-      beam_token_scores[word_id] = (score < 0 ? score * penalty : score / penalty);
+      beam_token_scores[word_id] = (score < 0 ? score * row_penalty : score / row_penalty);
     }
   }
 }
@@ -1,4 +1,6 @@
 #include "sequences.h"
+#include "stop_sequences.h"
+#include <random>
 
 namespace Generators {
 
@@ -12,6 +14,16 @@ struct Search {
 
   int GetSequenceLength();
 
+  // The parameters to create the model state with. With guidance the unconditional prompts are stacked after the
+  // conditional ones, so the model batch is twice the size and its logits are combined by SetLogits. With
+  // num_return_sequences the search's params_ have a row per sequence, the model's a row per prompt that it prefills once
+  // and copies to the sequences' rows.
+  SearchParams GetModelParams() const;
+  bool IsGuided() const { return params_.guidance_scale != 1.0f; }
+
+  // The batch entry of a row, the index into the per batch entry settings of params_ (like max_lengths)
+  int GetBatchIndex(int row) const { return row / (params_.num_beams * return_sequence_count_); }
+
   bool IsDone() const { return done_; }
   void SetLogits(std::span<const ScoreType> logits);
   // Extra scoring steps go here
@@ -22,7 +34,7 @@ struct Search {
 
   SearchParams params_;
 
-  std::span<int32_t> sequence_lengths_;  // shape (beam_size*batch_size)
+  std::span<int32_t> sequence_lengths_;  // shape (beam_size*batch_size), twice that with guidance
   std::unique_ptr<int32_t[]> sequence_lengths_buffer_;
 
   std::span<int32_t> next_tokens_;  // shape (beam_size*batch_size)
@@ -30,8 +42,27 @@ struct Search {
   std::span<ScoreType> next_token_scores_;  // shape (beam_size*batch_size, vocab_size)
   std::unique_ptr<ScoreType[]> next_token_scores_buffer_;
 
+  // Rows still being searched. A greedy row stops at its EOS, beams stop when their batch entry is done. SetLogits,
+  // the processors and the token selection skip the finished rows.
+  std::span<bool> row_active_;  // shape (beam_size*batch_size)
+  std::unique_ptr<bool[]> row_active_buffer_;
+
+  // Search row of each row of the model batch. Starts as every row, shrinks if the finished rows are compacted out of the
+  // model batch (see GreedySearch::CompactFinishedRows).
+  std::span<int32_t> model_rows_;
+  std::unique_ptr<int32_t[]> model_rows_buffer_;
+
+  // Only with stop sequences, each row's state in params_.stop_sequences
+  std::span<int> stop_states_;  // shape (beam_size*batch_size)
+  std::unique_ptr<int[]> stop_states_buffer_;
+
   Sequences sequences_;
   bool done_{};
+
+ protected:
+  std::vector<int32_t> guidance_input_ids_;  // The conditional then the unconditional prompts
+  int return_sequence_count_{1};             // params.num_return_sequences, params_ has a batch row per sequence
+  std::unique_ptr<ScoreType[]> guidance_scores_;  // shape (vocab_size), the unconditional scores of a row
 };
 
 struct GreedySearch : Search {
@@ -43,16 +74,28 @@ struct GreedySearch : Search {
   void SampleTopK(int k, float temperature);
   void SampleTopP(float p, float temperature);
 
+  // Call after selecting the next tokens to drop the rows that have finished from the model batch. Returns the indices of
+  // the rows kept in the previous model batch, to pass to the model state's CompactRows. GetNextTokens and SetLogits
+  // then only deal with the remaining rows.
+  std::span<const int32_t> CompactFinishedRows();
+
  private:
   bool PadIfAlreadyEOS(size_t batch_id);
   void SetNextToken(size_t batch_id, int32_t token);
+  void FinishRow(size_t batch_id);
   void AppendNextTokensToSequences();
 
+  std::vector<std::mt19937> generators_;  // The samplers' random numbers, one per row so a row's seed fixes its output
+
   std::unique_ptr<int32_t[]> next_tokens_buffer_;
   std::unique_ptr<int32_t[]> temp_topk_buffer_;
 
-  std::span<bool> eos_seen_;  // shape (batch_size)
-  std::unique_ptr<bool[]> eos_seen_buffer_;
+  std::span<int32_t> model_next_tokens_;  // next_tokens_ of the model_rows_, once the model batch is compacted
+  std::unique_ptr<int32_t[]> model_next_tokens_buffer_;
+  std::span<int32_t> guidance_next_tokens_;  // next_tokens_ twice, for the conditional and unconditional rows
+  std::unique_ptr<int32_t[]> guidance_next_tokens_buffer_;
+  std::span<int32_t> kept_rows_;
+  std::unique_ptr<int32_t[]> kept_rows_buffer_;
   int not_done_count_{params_.batch_size};  // When zero, every batch entry is done (starts at batch_size_)
 };
 
@@ -65,12 +108,29 @@ struct BeamSearch : Search {
 
   void SelectTop();
 
+  // With pruning a batch entry can end with fewer than num_return_sequences hypotheses, the sequences past them are
+  // padding with a score of -infinity.
   void Finalize(size_t num_return_sequences, std::span<int32_t> output, std::span<float> sequence_scores);
 
+  bool IsPruning() const { return params_.beam_prune_relative > 0.0f || params_.beam_prune_absolute > 0.0f; }
+
  private:
   void AppendNextTokensToSequences();
+  void CompactBeams();
 
   std::unique_ptr<BeamSearchScorer> beam_scorer_;
+
+  // With pruning only the active beams are in the model batch. Their next tokens, and the model rows of their beams in
+  // the model batch that was just run (for the model state to pick the past state from).
+  std::span<int32_t> model_next_tokens_, model_next_indices_;
+  std::unique_ptr<int32_t[]> model_next_tokens_buffer_, model_next_indices_buffer_;
+  std::unique_ptr<int32_t[]> model_row_of_buffer_;  // shape (beam_size*batch_size), model row of each search row
+
+  // Only with stop sequences, whether each candidate completes one, and the stop states the new beams' parents had
+  std::span<bool> next_stops_;  // shape (2*beam_size*batch_size)
+  std::unique_ptr<bool[]> next_stops_buffer_;
+  std::span<int> parent_stop_states_;  // shape (beam_size*batch_size)
+  std::unique_ptr<int[]> parent_stop_states_buffer_;
 };
 
 namespace Processors {
@@ -0,0 +1,56 @@
+#include "generators.h"
+#include "stop_sequences.h"
+
+namespace Generators {
+
+StopSequences::StopSequences(const std::vector<std::vector<int32_t>>& sequences)
+    : nodes_(1) {
+  // The trie of the sequences
+  for (auto& sequence : sequences) {
+    assert(!sequence.empty());
+    int state = 0;
+    for (int32_t token : sequence) {
+      auto found = nodes_[state].children_.find(token);
+      if (found != nodes_[state].children_.end()) {
+        state = found->second;
+        continue;
+      }
+      int child = static_cast<int>(nodes_.size());
+      nodes_[state].children_.emplace(token, child);
+      nodes_.emplace_back();
+      state = child;
+    }
+    nodes_[state].match_ = true;
+  }
+
+  // Fail links breadth first, so the links of every shorter node are set before they're followed
+  std::queue<int> queue;
+  for (auto& child : nodes_[0].children_)
+    queue.push(child.second);
+  while (!queue.empty()) {
+    int state = queue.front();
+    queue.pop();
+    for (auto& [token, child] : nodes_[state].children_) {
+      int fail = nodes_[state].fail_;
+      while (fail != 0 && !nodes_[fail].children_.count(token))
+        fail = nodes_[fail].fail_;
+      auto found = nodes_[fail].children_.find(token);
+      nodes_[child].fail_ = found != nodes_[fail].children_.end() && found->second != child ? found->second : 0;
+      nodes_[child].match_ |= nodes_[nodes_[child].fail_].match_;
+      queue.push(child);
+    }
+  }
+}
+
+int StopSequences::Next(int state, int32_t token) const {
+  while (true) {
+    auto found = nodes_[state].children_.find(token);
+    if (found != nodes_[state].children_.end())
+      return found->second;
+    if (state == 0)
+      return 0;
+    state = nodes_[state].fail_;
+  }
+}
+
+}  // namespace Generators
@@ -0,0 +1,24 @@
+#pragma once
+#include <unordered_map>
+
+namespace Generators {
+
+// Matches any of a set of token sequences as tokens are appended, with an Aho-Corasick automaton built once up front.
+// Each row being generated keeps its own state (starting at 0) and moves it along with every token it appends.
+struct StopSequences {
+  StopSequences(const std::vector<std::vector<int32_t>>& sequences);
+
+  int Next(int state, int32_t token) const;
+  bool IsMatch(int state) const { return nodes_[state].match_; }  // True if a stop sequence ends at the state's last token
+
+ private:
+  struct Node {
+    std::unordered_map<int32_t, int> children_;
+    int fail_{};     // The node of the longest proper suffix that's also in the trie
+    bool match_{};   // This node, or one of its suffixes, is the end of a stop sequence
+  };
+
+  std::vector<Node> nodes_;  // nodes_[0] is the root, the empty sequence
+};
+
+}  // namespace Generators
@@ -9,6 +9,32 @@ extern std::unique_ptr<OrtEnv> g_ort_env;
 
 void Test_GreedySearchTest_GptGreedySearchFp32();
 void Test_BeamSearchTest_GptBeamSearchFp32();
+void Test_GreedySearchTest_GptDecodeBufferAllocations();
+void Test_GreedySearchTest_GptPrefillLogits();
+void Test_BeamSearchTest_GptIoBinding();
+void Test_GreedySearchTest_GptChunkedPrefill();
+void Test_GreedySearchTest_GptCompactRows();
+void Test_GreedySearchTest_FinishedRowScores();
+void Test_GreedySearchTest_GptEngine();
+void Test_GreedySearchTest_GptConcurrent();
+void Test_GreedySearchTest_GptPipelined();
+void Test_GreedySearchTest_GptAsync();
+void Test_GreedySearchTest_GptShards();
+void Test_GreedySearchTest_GptDisaggregated();
+void Test_GreedySearchTest_GptInitDecoder();
+void Test_GreedySearchTest_GptSpeculative();
+void Test_GreedySearchTest_GptPromptLookup();
+void Test_GreedySearchTest_GptRunTokens();
+void Test_GreedySearchTest_GptGuidance();
+void Test_GreedySearchTest_GptScore();
+void Test_GreedySearchTest_GptReturnSequences();
+void Test_BeamSearchTest_GptBeamPruning();
+void Test_GreedySearchTest_GptStopSequences();
+void Test_BeamSearchTest_StopSequences();
+void Test_GreedySearchTest_GptPerRowParams();
+void Test_GreedySearchTest_GptPromptBatches();
+void Test_GreedySearchTest_LlamaRunTokens();
+void Test_BeamSearchTest_LlamaBeamSearch();
 
 #if USE_CUDA
 void LaunchTest(float* test, cudaStream_t stream);
@@ -29,11 +55,39 @@ int main()
   try {
     Test_GreedySearchTest_GptGreedySearchFp32();
     Test_BeamSearchTest_GptBeamSearchFp32();
+    Test_GreedySearchTest_GptDecodeBufferAllocations();
+    Test_GreedySearchTest_GptPrefillLogits();
+    Test_BeamSearchTest_GptIoBinding();
+    Test_GreedySearchTest_GptChunkedPrefill();
+    Test_GreedySearchTest_GptCompactRows();
+    Test_GreedySearchTest_FinishedRowScores();
+    Test_GreedySearchTest_GptEngine();
+    Test_GreedySearchTest_GptConcurrent();
+    Test_GreedySearchTest_GptPipelined();
+    Test_GreedySearchTest_GptAsync();
+    Test_GreedySearchTest_GptShards();
+    Test_GreedySearchTest_GptDisaggregated();
+    Test_GreedySearchTest_GptInitDecoder();
+    Test_GreedySearchTest_GptSpeculative();
+    Test_GreedySearchTest_GptPromptLookup();
+    Test_GreedySearchTest_GptRunTokens();
+    Test_GreedySearchTest_GptGuidance();
+    Test_GreedySearchTest_GptScore();
+    Test_GreedySearchTest_GptReturnSequences();
+    Test_BeamSearchTest_GptBeamPruning();
+    Test_GreedySearchTest_GptStopSequences();
+    Test_BeamSearchTest_StopSequences();
+    Test_GreedySearchTest_GptPerRowParams();
+    Test_GreedySearchTest_GptPromptBatches();
 
 #if USE_CUDA
     Test_GreedySearchTest_GptGreedySearchFp32_Cuda();
     Test_BeamSearchTest_GptBeamSearchFp32_Cuda();
 #endif
+
+    // Last, so nothing is left unrun if the Llama model fails to load. They skip themselves if it hasn't been exported.
+    Test_GreedySearchTest_LlamaRunTokens();
+    Test_BeamSearchTest_LlamaBeamSearch();
   }
   catch (const std::exception& e)
   {
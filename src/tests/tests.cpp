@@ -1,20 +1,95 @@
 #include "../generators.h"
 #include "../search.h"
 #include "../models/gpt_cpu.h"
+#include "../models/gpt_engine.h"
+#include "../models/gpt_pipeline.h"
+#include "../models/gpt_async.h"
+#include "../models/gpt_shards.h"
+#include "../models/gpt_speculative.h"
+#include "../models/gpt_score.h"
+#include "../models/llama_cpu.h"
+#include "../prompt_batches.h"
 #if USE_CUDA
 #include "../search_cuda.h"
 #include "../models/gpt_cuda.h"
 #endif
+#include <filesystem>
 #include <iostream>
+#include <thread>
 
 // Our working directory is generators/build so one up puts us in the root directory:
 #define MODEL_PATH "../test_models/"
+// Exported by download_llama.py -m hf-internal-testing/tiny-random-LlamaForCausalLM, see "Test models" in the README
+#define LLAMA_MODEL_PATH MODEL_PATH "hf-internal-testing/tiny-random-LlamaForCausalLM/tiny-random-LlamaForCausalLM_decoder_merged_model_fp32_opt.onnx"
 
 #define ASSERT_EQ(a, b) assert((a) == (b))
 #define ASSERT_TRUE(a) assert(a)
 
 std::unique_ptr<OrtEnv> g_ort_env;
 
+#define TINY_GPT2_PATH MODEL_PATH "hf-internal-testing/tiny-random-gpt2_past_fp32.onnx"
+
+// The prompts, search params and expected output of the tiny gpt2 greedy search test, shared by the tests that build on
+// it. The params point into the fixture, so it isn't copied.
+struct TinyGpt2Greedy {
+  TinyGpt2Greedy(const Generators::Gpt_Model& model) {
+    params.max_length = 10;
+    params.batch_size = 2;
+    params.sequence_length = 4;
+    params.input_ids = input_ids;
+    params.vocab_size = model.GetVocabSize();
+    params.eos_token_id = params.pad_token_id = 98;
+  }
+  TinyGpt2Greedy(const TinyGpt2Greedy&) = delete;
+
+  // True if 'sequence' is prompt 'row's expected output, or if 'length' is given starts with that many of its tokens
+  bool IsExpected(std::span<int32_t> sequence, int row, int length = 0) const {
+    const int32_t* expected = expected_output.data() + row * params.max_length;
+    if (length > 0)
+      return sequence.size() >= static_cast<size_t>(length) && std::equal(expected, expected + length, sequence.begin());
+    return std::equal(expected, expected + params.max_length, sequence.begin(), sequence.end());
+  }
+
+  // True if every row of the search is its prompt's expected output
+  bool IsExpected(Generators::Search& search) const {
+    for (int i = 0; i < search.params_.batch_size; i++) {
+      if (!IsExpected(search.sequences_.GetSequence(i), i))
+        return false;
+    }
+    return true;
+  }
+
+  std::vector<int32_t> input_ids{0, 0, 0, 52, 0, 0, 195, 731};
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+  Generators::SearchParams params;
+};
+
+// The same for the tiny gpt2 beam search test
+struct TinyGpt2Beam {
+  TinyGpt2Beam(const Generators::Gpt_Model& model) {
+    params.batch_size = 3;
+    params.sequence_length = 12;
+    params.input_ids = input_ids;
+    params.max_length = 20;
+    params.vocab_size = model.GetVocabSize();
+    params.eos_token_id = params.pad_token_id = 98;
+    params.num_beams = 4;
+  }
+  TinyGpt2Beam(const TinyGpt2Beam&) = delete;
+
+  std::vector<int32_t> input_ids{
+      0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620,
+      41, 554, 74, 622, 206, 222, 75, 223, 221, 198, 224, 572,
+      0, 0, 0, 52, 328, 219, 328, 206, 288, 227, 896, 328};
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620, 131, 131, 131, 181, 638, 638, 638, 638,
+      41, 554, 74, 622, 206, 222, 75, 223, 221, 198, 224, 572, 292, 292, 292, 292, 292, 292, 292, 292,
+      0, 0, 0, 52, 328, 219, 328, 206, 288, 227, 896, 328, 328, 669, 669, 669, 669, 669, 669, 669};
+  Generators::SearchParams params;
+};
+
 void Test_BeamSearchTest_GptBeamSearchFp32() {
 
   int32_t max_length{20};
@@ -119,6 +194,1082 @@ void Test_GreedySearchTest_GptGreedySearchFp32() {
   std::cout << "Test_GreedySearchTest_GptGreedySearchFp32 complete\r\n";
 }
 
+// Forwards to the default allocator, counting how many allocations were made through it
+struct CountingAllocator : OrtAllocator {
+  CountingAllocator() : OrtAllocator{} {
+    version = ORT_API_VERSION;
+    OrtAllocator::Alloc = [](OrtAllocator* this_, size_t size) {
+      auto& self = *static_cast<CountingAllocator*>(this_);
+      self.allocation_count_++;
+      self.largest_allocation_ = std::max(self.largest_allocation_, size);
+      return self.allocator_.Alloc(size);
+    };
+    OrtAllocator::Free = [](OrtAllocator* this_, void* p) { static_cast<CountingAllocator*>(this_)->allocator_.Free(p); };
+    OrtAllocator::Info = [](const OrtAllocator* this_) { return &static_cast<const CountingAllocator*>(this_)->allocator_.GetInfo(); };
+  }
+
+  Ort::Allocator& allocator_{Ort::Allocator::GetWithDefaultOptions()};
+  int allocation_count_{};
+  size_t largest_allocation_{};
+};
+
+void Test_GreedySearchTest_GptDecodeBufferAllocations() {
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  CountingAllocator allocator;
+  model.allocator_cpu_ = &allocator;
+  TinyGpt2Greedy fixture{model};
+
+  Generators::GreedySearch search{fixture.params};
+  Generators::Gpt_State gpt{model, search.sequence_lengths_, fixture.params};
+
+  // Every buffer the state needs is allocated on construction, so no step may allocate one. This only sees the buffers
+  // allocated through the model's allocator, not the tensor views ORT creates over them every step.
+  int allocation_count = allocator.allocation_count_;
+  while (!search.IsDone()) {
+    search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+    ASSERT_EQ(allocator.allocation_count_, allocation_count);
+
+    search.SelectTop();
+  }
+
+  ASSERT_TRUE(fixture.IsExpected(search));
+
+  std::cout << "Test_GreedySearchTest_GptDecodeBufferAllocations complete\r\n";
+}
+
+void Test_GreedySearchTest_GptPrefillLogits() {
+
+  // The test model has logits for every position and no 'last_logits' output. The prefill still only fetches the last
+  // position's, with the prompt run at once or in chunks, so no buffer is as big as the logits of the whole prompt.
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  ASSERT_TRUE(model.logits_uses_seq_len_ && !model.has_last_logits_);
+  CountingAllocator allocator;
+  model.allocator_cpu_ = &allocator;
+  TinyGpt2Greedy fixture{model};
+  auto& params = fixture.params;
+  size_t prompt_logits_size = sizeof(Generators::ScoreType) * params.batch_size * params.sequence_length * params.vocab_size;
+
+  for (int chunk_size : {0, 2}) {
+    Generators::GreedySearch search{params};
+    Generators::Gpt_State gpt{model, search.sequence_lengths_, params, chunk_size};
+    ASSERT_TRUE(allocator.largest_allocation_ < prompt_logits_size);
+
+    auto logits = gpt.Run(search.GetSequenceLength(), search.GetNextTokens());
+    ASSERT_TRUE(logits.size() == static_cast<size_t>(params.batch_size * params.vocab_size));
+    search.SetLogits(logits);
+    search.SelectTop();
+    while (!search.IsDone()) {
+      search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+      search.SelectTop();
+    }
+
+    ASSERT_TRUE(fixture.IsExpected(search));
+  }
+
+  std::cout << "Test_GreedySearchTest_GptPrefillLogits complete\r\n";
+}
+
+void Test_BeamSearchTest_GptIoBinding() {
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  TinyGpt2Beam fixture{model};
+
+  Generators::BeamSearch search{fixture.params};
+  Generators::Gpt_State gpt{model, search.sequence_lengths_, fixture.params};
+  gpt.UseIoBinding(search.next_token_scores_);
+
+  while (!search.IsDone()) {
+    search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens(), search.GetNextIndices()));
+
+    Generators::Processors::MinLength(search, 1);
+    Generators::Processors::RepetitionPenalty(search, 1.0f);
+
+    search.SelectTop();
+  }
+
+  std::vector<int32_t> output_sequence(fixture.params.batch_size * fixture.params.max_length);
+  search.Finalize(1, output_sequence, {});
+
+  // Verify outputs match the unbound beam search
+  ASSERT_TRUE(output_sequence == fixture.expected_output);
+
+  std::cout << "Test_BeamSearchTest_GptIoBinding complete\r\n";
+}
+
+void Test_GreedySearchTest_GptChunkedPrefill() {
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  TinyGpt2Greedy fixture{model};
+
+  // Two tokens at a time divides the prompt evenly, three leaves a shorter last chunk
+  for (int chunk_size : {2, 3}) {
+    Generators::GreedySearch search{fixture.params};
+    Generators::Gpt_State gpt{model, search.sequence_lengths_, fixture.params, chunk_size};
+
+    while (!search.IsDone()) {
+      search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+      search.SelectTop();
+    }
+
+    ASSERT_TRUE(fixture.IsExpected(search));
+  }
+
+  std::cout << "Test_GreedySearchTest_GptChunkedPrefill complete\r\n";
+}
+
+void Test_GreedySearchTest_GptCompactRows() {
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  TinyGpt2Greedy fixture{model};
+
+  // With 204 as the EOS token the first row finishes on its first token, the second row must be unaffected
+  fixture.params.eos_token_id = 204;
+  std::vector<int32_t> expected_output0{0, 0, 0, 52, 204, 98, 98, 98, 98, 98};
+
+  Generators::GreedySearch search{fixture.params};
+  Generators::Gpt_State gpt{model, search.sequence_lengths_, fixture.params};
+
+  while (!search.IsDone()) {
+    search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+    search.SelectTop();
+    gpt.CompactRows(search.CompactFinishedRows());
+  }
+  ASSERT_EQ(search.model_rows_.size(), 1);
+
+  auto sequence0 = search.sequences_.GetSequence(0);
+  ASSERT_TRUE(std::equal(expected_output0.begin(), expected_output0.end(), sequence0.begin(), sequence0.end()));
+  ASSERT_TRUE(fixture.IsExpected(search.sequences_.GetSequence(1), 1));
+
+  std::cout << "Test_GreedySearchTest_GptCompactRows complete\r\n";
+}
+
+void Test_GreedySearchTest_FinishedRowScores() {
+
+  // Row 0 picks its EOS (token 3) on the first step, row 1 carries on
+  std::vector<int32_t> input_ids{0, 0};
+  std::vector<Generators::ScoreType> logits{
+      0.0f, 1.0f, 2.0f, 8.0f,
+      0.0f, 8.0f, 2.0f, 1.0f};
+
+  Generators::SearchParams params;
+  params.max_length = 10;
+  params.batch_size = 2;
+  params.sequence_length = 1;
+  params.input_ids = input_ids;
+  params.vocab_size = 4;
+  params.eos_token_id = params.pad_token_id = 3;
+
+  Generators::GreedySearch search{params};
+  search.SetLogits(logits);
+  search.SelectTop();
+  ASSERT_TRUE(!search.row_active_[0] && search.row_active_[1]);
+
+  auto finished_scores = search.GetScores(0);
+  std::vector<Generators::ScoreType> expected_scores(finished_scores.begin(), finished_scores.end());
+
+  // Neither the logits, the processors nor the samplers touch the finished row's scores, and it's only padded
+  std::vector<Generators::ScoreType> next_logits{
+      5.0f, 4.0f, 3.0f, 2.0f,
+      0.0f, 8.0f, 2.0f, 1.0f};
+  auto step = [&](auto select_top) {
+    search.SetLogits(next_logits);
+    Generators::Processors::MinLength(search, 8);
+    Generators::Processors::RepetitionPenalty(search, 2.0f);
+    select_top();
+    ASSERT_TRUE(std::equal(expected_scores.begin(), expected_scores.end(), finished_scores.begin(), finished_scores.end()));
+    ASSERT_EQ(search.GetNextTokens()[0], params.pad_token_id);
+  };
+  step([&] { search.SelectTop(); });
+  step([&] { search.SampleTopK(2, 1.0f); });
+  step([&] { search.SampleTopP(0.9f, 1.0f); });
+
+  std::cout << "Test_GreedySearchTest_FinishedRowScores complete\r\n";
+}
+
+void Test_GreedySearchTest_GptEngine() {
+
+  std::vector<int32_t> input_ids0{0, 0, 0, 52};
+  std::vector<int32_t> input_ids1{0, 0, 195, 731};
+
+  // Same as the batched greedy search, minus the prompts
+  std::vector<int32_t> expected_output0{204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{731, 114, 114, 114, 114, 114};
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  Generators::Gpt_Engine engine{model, 2, 10};
+
+  Generators::SearchParams params;
+  params.max_length = 10;
+  params.batch_size = 1;
+  params.sequence_length = 4;
+  params.vocab_size = model.GetVocabSize();
+  params.eos_token_id = params.pad_token_id = 98;
+
+  params.input_ids = input_ids0;
+  auto request0 = engine.Add(params);
+
+  // The second request joins the running batch two steps later, so it starts out shorter than the first row
+  std::vector<int32_t> output0, output1;
+  std::shared_ptr<Generators::Gpt_Request> request1;
+  for (int step = 0; engine.Step(); step++) {
+    if (step == 1) {
+      params.input_ids = input_ids1;
+      request1 = engine.Add(params);
+    }
+  }
+
+  ASSERT_TRUE(request0->IsDone() && request1->IsDone());
+  request0->TakeTokens(output0);
+  request1->TakeTokens(output1);
+  ASSERT_TRUE(output0 == expected_output0);
+  ASSERT_TRUE(output1 == expected_output1);
+
+  // Left padded prompts give the same tokens in the engine as run on their own, so their position ids agree. The short
+  // request finishes early and the third one takes its row.
+  std::vector<int32_t> padded_ids0{98, 98, 0, 52}, padded_ids1{98, 195, 731, 321}, padded_ids2{98, 98, 98, 731};
+  std::vector<int32_t> max_lengths{10, 6, 9};
+  std::vector<std::vector<int32_t>> prompts{padded_ids0, padded_ids1, padded_ids2};
+
+  auto generate = [&](std::vector<int32_t>& input_ids, int max_length) {
+    Generators::SearchParams alone_params = params;
+    alone_params.input_ids = input_ids;
+    alone_params.max_length = max_length;
+    Generators::GreedySearch search{alone_params};
+    Generators::Gpt_State gpt{model, search.sequence_lengths_, alone_params};
+    while (!search.IsDone()) {
+      search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+      search.SelectTop();
+    }
+    auto sequence = search.sequences_.GetSequence(0);
+    return std::vector<int32_t>(sequence.begin() + alone_params.sequence_length, sequence.begin() + search.GetSequenceLength());
+  };
+
+  std::vector<std::shared_ptr<Generators::Gpt_Request>> requests;
+  auto add = [&](size_t i) {
+    params.input_ids = prompts[i];
+    params.max_length = max_lengths[i];
+    requests.push_back(engine.Add(params));
+  };
+  add(0);
+  add(1);
+  while (engine.Step()) {
+    if (requests.size() == 2 && requests[1]->IsDone())
+      add(2);
+  }
+
+  ASSERT_EQ(requests.size(), 3);
+  for (size_t i = 0; i < requests.size(); i++) {
+    std::vector<int32_t> output;
+    requests[i]->TakeTokens(output);
+    ASSERT_TRUE(output == generate(prompts[i], max_lengths[i]));
+  }
+
+  std::cout << "Test_GreedySearchTest_GptEngine complete\r\n";
+}
+
+void Test_GreedySearchTest_GptConcurrent() {
+
+  // One model shared by every thread, each thread has its own search and state
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  TinyGpt2Greedy fixture{model};
+
+  auto generate = [&]() {
+    Generators::GreedySearch search{fixture.params};
+    Generators::Gpt_State gpt{model, search.sequence_lengths_, fixture.params};
+
+    while (!search.IsDone()) {
+      search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+      search.SelectTop();
+    }
+
+    ASSERT_TRUE(fixture.IsExpected(search));
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < 8; i++)
+    threads.emplace_back(generate);
+  for (auto& thread : threads)
+    thread.join();
+
+  std::cout << "Test_GreedySearchTest_GptConcurrent complete\r\n";
+}
+
+void Test_GreedySearchTest_GptPipelined() {
+
+  std::vector<int32_t> input_ids0{0, 0, 0, 52};
+  std::vector<int32_t> input_ids1{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output0{0, 0, 0, 52, 204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{0, 0, 195, 731, 731, 114, 114, 114};
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+
+  Generators::SearchParams params;
+  params.batch_size = 1;
+  params.sequence_length = 4;
+  params.vocab_size = model.GetVocabSize();
+  params.eos_token_id = params.pad_token_id = 98;
+
+  // Different lengths, so one micro batch finishes first
+  params.max_length = 10;
+  params.input_ids = input_ids0;
+  Generators::GreedySearch search0{params};
+  Generators::Gpt_State gpt0{model, search0.sequence_lengths_, params};
+
+  params.max_length = 8;
+  params.input_ids = input_ids1;
+  Generators::GreedySearch search1{params};
+  Generators::Gpt_State gpt1{model, search1.sequence_lengths_, params};
+
+  Generators::RunPipelined(search0, gpt0, search1, gpt1, [](Generators::GreedySearch& search) { search.SelectTop(); });
+
+  auto sequence0 = search0.sequences_.GetSequence(0);
+  auto sequence1 = search1.sequences_.GetSequence(0);
+  ASSERT_TRUE(std::equal(expected_output0.begin(), expected_output0.end(), sequence0.begin(), sequence0.end()));
+  ASSERT_TRUE(std::equal(expected_output1.begin(), expected_output1.end(), sequence1.begin(), sequence1.end()));
+
+  std::cout << "Test_GreedySearchTest_GptPipelined complete\r\n";
+}
+
+Generators::Gpt_Task GenerateAsync(Generators::Gpt_Scheduler& scheduler, Generators::SearchParams params, std::vector<int32_t>& tokens) {
+  auto request = scheduler.Add(params);
+  while (auto token = co_await scheduler.NextToken(*request))
+    tokens.push_back(*token);
+}
+
+void Test_GreedySearchTest_GptAsync() {
+
+  std::vector<int32_t> input_ids0{0, 0, 0, 52};
+  std::vector<int32_t> input_ids1{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output0{204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{731, 114, 114, 114, 114, 114};
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  Generators::Gpt_Scheduler scheduler{model, 4, 10};
+
+  Generators::SearchParams params;
+  params.max_length = 10;
+  params.batch_size = 1;
+  params.sequence_length = 4;
+  params.vocab_size = model.GetVocabSize();
+  params.eos_token_id = params.pad_token_id = 98;
+
+  // More generations than rows in the batch, the later ones wait for rows to free up
+  std::vector<std::vector<int32_t>> outputs(8);
+  for (size_t i = 0; i < outputs.size(); i++) {
+    params.input_ids = i % 2 ? input_ids1 : input_ids0;
+    scheduler.Spawn(GenerateAsync(scheduler, params, outputs[i]));
+  }
+  scheduler.Run(2);
+
+  for (size_t i = 0; i < outputs.size(); i++)
+    ASSERT_TRUE(outputs[i] == (i % 2 ? expected_output1 : expected_output0));
+
+  std::cout << "Test_GreedySearchTest_GptAsync complete\r\n";
+}
+
+void Test_GreedySearchTest_GptShards() {
+
+  std::vector<int32_t> input_ids0{0, 0, 0, 52};
+  std::vector<int32_t> input_ids1{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output0{204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{731, 114, 114, 114, 114, 114};
+
+  // Emulate two NUMA nodes by splitting the first node's CPUs in half
+  auto cpus = Generators::GetNumaNodeCpus()[0];
+  size_t half = std::max<size_t>(cpus.size() / 2, 1);
+  std::vector<std::vector<int>> shard_cpus{{cpus.begin(), cpus.begin() + half}, {cpus.end() - half, cpus.end()}};
+
+  Generators::Gpt_Shards shards(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH), shard_cpus, 2, 10);
+
+  Generators::SearchParams params;
+  params.max_length = 10;
+  params.batch_size = 1;
+  params.sequence_length = 4;
+  params.vocab_size = shards.GetVocabSize();
+  params.eos_token_id = params.pad_token_id = 98;
+
+  std::vector<std::shared_ptr<Generators::Gpt_Request>> requests;
+  for (int i = 0; i < 4; i++) {
+    params.input_ids = i % 2 ? input_ids1 : input_ids0;
+    requests.push_back(shards.Add(params));
+  }
+
+  for (auto& request : requests) {
+    while (!request->IsDone())
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  for (int i = 0; i < 4; i++) {
+    std::vector<int32_t> output;
+    requests[i]->TakeTokens(output);
+    ASSERT_TRUE(output == (i % 2 ? expected_output1 : expected_output0));
+  }
+
+  std::cout << "Test_GreedySearchTest_GptShards complete\r\n";
+}
+
+void Test_GreedySearchTest_GptDisaggregated() {
+
+  std::vector<int32_t> input_ids0{0, 0, 0, 52};
+  std::vector<int32_t> input_ids1{0, 0, 195, 731};
+
+  std::vector<int32_t> expected_output0{204, 204, 204, 204, 204, 204};
+  std::vector<int32_t> expected_output1{731, 114, 114, 114, 114, 114};
+
+  // Prefill gets its own session and thread pool, sharing the decoder session's prepacked weights
+  auto session_options = OrtSessionOptions::Create();
+  auto prefill_options = OrtSessionOptions::Create();
+  prefill_options->SetIntraOpNumThreads(1);
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH), *session_options, *prefill_options);
+  ASSERT_TRUE(model.session_prefill_);
+  Generators::Gpt_Engine engine{model, 2, 10, true};
+
+  Generators::SearchParams params;
+  params.max_length = 10;
+  params.batch_size = 1;
+  params.sequence_length = 4;
+  params.vocab_size = model.GetVocabSize();
+  params.eos_token_id = params.pad_token_id = 98;
+
+  std::vector<std::shared_ptr<Generators::Gpt_Request>> requests;
+  for (int i = 0; i < 4; i++) {
+    params.input_ids = i % 2 ? input_ids1 : input_ids0;
+    requests.push_back(engine.Add(params));
+  }
+
+  while (engine.Step()) {
+  }
+
+  for (int i = 0; i < 4; i++) {
+    ASSERT_TRUE(requests[i]->IsDone());
+    std::vector<int32_t> output;
+    requests[i]->TakeTokens(output);
+    ASSERT_TRUE(output == (i % 2 ? expected_output1 : expected_output0));
+  }
+
+  std::cout << "Test_GreedySearchTest_GptDisaggregated complete\r\n";
+}
+
+void Test_GreedySearchTest_GptInitDecoder() {
+
+  // There is no exported init decoder for the test model, the decoder itself stands in for it (with an empty past)
+  auto session_options = OrtSessionOptions::Create();
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH), ORT_TSTR_ON_MACRO(TINY_GPT2_PATH), *session_options);
+  TinyGpt2Greedy fixture{model};
+
+  Generators::GreedySearch search{fixture.params};
+  Generators::Gpt_State gpt{model, search.sequence_lengths_, fixture.params};
+
+  while (!search.IsDone()) {
+    search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+    search.SelectTop();
+  }
+
+  ASSERT_TRUE(fixture.IsExpected(search));
+
+  std::cout << "Test_GreedySearchTest_GptInitDecoder complete\r\n";
+}
+
+void Test_GreedySearchTest_GptSpeculative() {
+
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+  std::vector<int32_t> expected_output{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  // The test model is its own draft, so every proposed token is accepted
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+
+  Generators::SearchParams params;
+  params.max_length = 10;
+  params.batch_size = 1;
+  params.sequence_length = static_cast<int>(input_ids.size());
+  params.input_ids = input_ids;
+  params.vocab_size = model.GetVocabSize();
+  params.eos_token_id = params.pad_token_id = 98;
+
+  Generators::Gpt_Speculative greedy{model, model, params, 3};
+  int steps = 0;
+  for (; !greedy.IsDone(); steps++) {
+    greedy.Step();
+    ASSERT_EQ(greedy.GetPastLength(), static_cast<int>(greedy.GetSequence().size()) - 1);
+  }
+
+  auto sequence = greedy.GetSequence();
+  ASSERT_TRUE(std::equal(expected_output.begin(), expected_output.end(), sequence.begin(), sequence.end()));
+  ASSERT_TRUE(greedy.accepted_count_ == greedy.drafted_count_ && steps < 6);
+
+  // A wrong draft: after 731, 731 the prompt lookup proposes 731 again (what followed the earlier 731) but the model
+  // picks 114. The draft is rejected, the check's past state is rolled back and the output is still greedy's.
+  Generators::Gpt_Speculative rejected{model, params, 3, 1};
+  rejected.Step();
+  ASSERT_TRUE(rejected.drafted_count_ == 1 && rejected.accepted_count_ == 0);
+  ASSERT_TRUE(rejected.GetSequence().size() == 6 && rejected.GetSequence()[5] == 114);
+  ASSERT_EQ(rejected.GetPastLength(), 5);
+  while (!rejected.IsDone()) {
+    rejected.Step();
+    ASSERT_EQ(rejected.GetPastLength(), static_cast<int>(rejected.GetSequence().size()) - 1);
+  }
+  auto rejected_sequence = rejected.GetSequence();
+  ASSERT_TRUE(std::equal(expected_output.begin(), expected_output.end(), rejected_sequence.begin(), rejected_sequence.end()));
+
+  // Sampled, the output is random so only check it runs to the end with the prompt intact
+  Generators::Gpt_Speculative sampled{model, model, params, 3, 1.0f, 0};
+  while (!sampled.IsDone())
+    sampled.Step();
+  auto sampled_sequence = sampled.GetSequence();
+  ASSERT_TRUE(sampled_sequence.size() <= 10 && std::equal(input_ids.begin(), input_ids.end(), sampled_sequence.begin()));
+
+  std::cout << "Test_GreedySearchTest_GptSpeculative complete\r\n";
+}
+
+void Test_GreedySearchTest_GptPromptLookup() {
+
+  std::vector<int32_t> input_ids{0, 0, 195, 731};
+  std::vector<int32_t> expected_output{0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+
+  Generators::SearchParams params;
+  params.max_length = 10;
+  params.batch_size = 1;
+  params.sequence_length = static_cast<int>(input_ids.size());
+  params.input_ids = input_ids;
+  params.vocab_size = model.GetVocabSize();
+  params.eos_token_id = params.pad_token_id = 98;
+
+  Generators::Gpt_Speculative lookup{model, params, 3, 2};
+  while (!lookup.IsDone())
+    lookup.Step();
+
+  // Once 114 repeats, the lookup proposes more of it
+  auto sequence = lookup.GetSequence();
+  ASSERT_TRUE(std::equal(expected_output.begin(), expected_output.end(), sequence.begin(), sequence.end()));
+  ASSERT_TRUE(lookup.accepted_count_ > 0);
+
+  std::cout << "Test_GreedySearchTest_GptPromptLookup complete\r\n";
+}
+
+void Test_GreedySearchTest_GptRunTokens() {
+
+  // The prompt {0, 0, 195, 731} in two parts, its greedy continuation is 731 then 114
+  std::vector<int32_t> input_ids{0, 0};
+  std::vector<int32_t> turn{195, 731};
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+
+  Generators::SearchParams params;
+  params.max_length = 10;
+  params.batch_size = 1;
+  params.sequence_length = static_cast<int>(input_ids.size());
+  params.input_ids = input_ids;
+  params.vocab_size = model.GetVocabSize();
+  params.eos_token_id = params.pad_token_id = 98;
+
+  int32_t sequence_length;
+  Generators::Gpt_State gpt{model, std::span<int32_t>(&sequence_length, 1), params};
+  gpt.Run(2, {});
+
+  auto argmax = [&](std::span<const Generators::ScoreType> logits, int position) {
+    auto scores = logits.data() + position * params.vocab_size;
+    return static_cast<int32_t>(std::max_element(scores, scores + params.vocab_size) - scores);
+  };
+
+  // Append the rest of the prompt, then roll it back and append it again
+  for (int i = 0; i < 2; i++) {
+    auto logits = gpt.RunTokens(turn, 2);
+    ASSERT_TRUE(gpt.GetPastLength() == 4 && argmax(logits, 1) == 731);
+    if (i == 0)
+      gpt.Truncate(2);
+  }
+
+  int32_t next_token = 731;
+  ASSERT_TRUE(argmax(gpt.Run(5, std::span<const int32_t>(&next_token, 1)), 0) == 114);
+
+  std::cout << "Test_GreedySearchTest_GptRunTokens complete\r\n";
+}
+
+void Test_GreedySearchTest_GptGuidance() {
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  TinyGpt2Greedy fixture{model};
+  auto& params = fixture.params;
+  params.guidance_scale = 1.5f;
+
+  // With the same unconditional prompts guidance changes nothing, with others it still runs to max_length
+  std::vector<int32_t> unconditional_input_ids{0, 0, 195, 731, 0, 0, 0, 52};
+  for (auto unconditional : {std::span<const int32_t>(fixture.input_ids), std::span<const int32_t>(unconditional_input_ids)}) {
+    params.unconditional_input_ids = unconditional;
+
+    Generators::GreedySearch search{params};
+    Generators::Gpt_State gpt{model, search.sequence_lengths_, search.GetModelParams()};
+
+    while (!search.IsDone()) {
+      search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+      search.SelectTop();
+    }
+
+    for (int i = 0; i < params.batch_size; i++) {
+      auto sequence = search.sequences_.GetSequence(i);
+      if (unconditional.data() == fixture.input_ids.data())
+        ASSERT_TRUE(fixture.IsExpected(sequence, i));
+      else
+        ASSERT_TRUE(sequence.size() == static_cast<size_t>(params.max_length) && fixture.IsExpected(sequence, i, params.sequence_length));
+    }
+  }
+
+  std::cout << "Test_GreedySearchTest_GptGuidance complete\r\n";
+}
+
+void Test_GreedySearchTest_GptScore() {
+
+  // The greedy continuations of the two prompts, then a token greedy search doesn't pick
+  std::vector<int32_t> prompt0{0, 0, 0, 52}, prompt1{0, 0, 195, 731};
+  std::vector<int32_t> continuation0{204, 204, 204}, continuation1{731, 114}, other{731};
+  std::vector<std::span<const int32_t>> prompts{prompt0, prompt1, prompt0};
+  std::vector<std::span<const int32_t>> continuations{continuation0, continuation1, other};
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+
+  // Scored all in one batch, then one at a time without padding
+  std::vector<Generators::ScoreType> token_scores;
+  auto scores = Generators::ScoreContinuations(model, prompts, continuations, 3, &token_scores);
+  auto single_scores = Generators::ScoreContinuations(model, prompts, continuations, 1);
+
+  ASSERT_TRUE(scores.size() == 3 && token_scores.size() == 6);
+  for (size_t i = 0; i < scores.size(); i++)
+    ASSERT_TRUE(scores[i] <= 0.0f && std::abs(scores[i] - single_scores[i]) < 1e-3f);
+  ASSERT_TRUE(std::abs(token_scores[0] + token_scores[1] + token_scores[2] - scores[0]) < 1e-3f);
+  ASSERT_TRUE(token_scores[0] > token_scores[5]);  // 204 is the greedy token after prompt0, not 731
+
+  std::cout << "Test_GreedySearchTest_GptScore complete\r\n";
+}
+
+void Test_GreedySearchTest_GptReturnSequences() {
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  TinyGpt2Greedy fixture{model};
+  auto& params = fixture.params;
+  params.num_return_sequences = 3;
+
+  // Greedy, every sequence returned for a prompt is that prompt's greedy output. Sampled, they keep the prompt.
+  for (bool sample : {false, true}) {
+    Generators::GreedySearch search{params};
+    Generators::Gpt_State gpt{model, search.sequence_lengths_, search.GetModelParams()};
+
+    while (!search.IsDone()) {
+      search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+      if (sample)
+        search.SampleTopP(0.9f, 1.0f);
+      else
+        search.SelectTop();
+    }
+
+    ASSERT_TRUE(search.params_.batch_size == 6);
+    for (int i = 0; i < search.params_.batch_size; i++) {
+      auto sequence = search.sequences_.GetSequence(i);
+      ASSERT_TRUE(fixture.IsExpected(sequence, i / params.num_return_sequences, sample ? params.sequence_length : params.max_length));
+    }
+  }
+
+  std::cout << "Test_GreedySearchTest_GptReturnSequences complete\r\n";
+}
+
+void Test_BeamSearchTest_GptBeamPruning() {
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  TinyGpt2Beam fixture{model};
+  auto& params = fixture.params;
+  int max_length = params.max_length;
+
+  // A margin no beam trails by only drops the finished batch entries from the model batch, so the output is unchanged.
+  // A tight one prunes down to a beam or two, the prompts come through.
+  for (float prune_absolute : {1000.0f, 0.1f}) {
+    params.beam_prune_absolute = prune_absolute;
+
+    Generators::BeamSearch search{params};
+    Generators::Gpt_State gpt{model, search.sequence_lengths_, params};
+
+    size_t smallest_batch = params.BatchBeamSize();
+    while (!search.IsDone()) {
+      search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens(), search.GetNextIndices()));
+      search.SelectTop();
+      if (!search.IsDone())
+        smallest_batch = std::min(smallest_batch, search.GetNextTokens().size());
+    }
+    if (prune_absolute < 1.0f)
+      ASSERT_TRUE(smallest_batch < static_cast<size_t>(params.BatchBeamSize()));
+
+    // Every beam is asked for, pruned entries have fewer hypotheses than that. The missing ones are padding scored -inf.
+    int num_beams = params.num_beams;
+    std::vector<int32_t> output_sequence(params.batch_size * num_beams * max_length);
+    std::vector<float> sequence_scores(params.batch_size * num_beams);
+    search.Finalize(num_beams, output_sequence, sequence_scores);
+
+    for (int i = 0; i < params.batch_size; i++) {
+      auto* expected_output_start = &fixture.expected_output[i * max_length];
+      int compared_length = prune_absolute > 1.0f ? max_length : params.sequence_length;
+      ASSERT_TRUE(std::equal(expected_output_start, expected_output_start + compared_length, output_sequence.begin() + i * num_beams * max_length));
+
+      for (int j = 0; j < num_beams; j++) {
+        auto sequence = output_sequence.begin() + (i * num_beams + j) * max_length;
+        float score = sequence_scores[i * num_beams + j];
+        if (std::isfinite(score)) {
+          ASSERT_TRUE(std::equal(expected_output_start, expected_output_start + params.sequence_length, sequence));
+          ASSERT_TRUE(j == 0 || score <= sequence_scores[i * num_beams + j - 1]);
+        } else {
+          ASSERT_TRUE(j > 0 && prune_absolute < 1.0f);
+          ASSERT_TRUE(std::all_of(sequence, sequence + max_length, [&](int32_t token) { return token == params.pad_token_id; }));
+        }
+      }
+    }
+  }
+
+  std::cout << "Test_BeamSearchTest_GptBeamPruning complete\r\n";
+}
+
+void Test_GreedySearchTest_GptStopSequences() {
+
+  // Overlapping stop sequences, {2, 3} is found inside {1, 2, 3, 4} through the failure links
+  Generators::StopSequences matcher{{{1, 2, 3, 4}, {2, 3}, {5, 5, 6}}};
+  std::vector<int32_t> tokens{1, 2, 3, 5, 5, 5, 6};
+  std::vector<bool> expected_matches{false, false, true, false, false, false, true};
+  int state = 0;
+  for (size_t i = 0; i < tokens.size(); i++) {
+    state = matcher.Next(state, tokens[i]);
+    ASSERT_TRUE(matcher.IsMatch(state) == expected_matches[i]);
+  }
+
+  // The rows stop at the end of their stop sequence, which is kept, and the search stops once both have
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 204,
+      0, 0, 195, 731, 731, 114, 98};
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  Generators::StopSequences stop_sequences{{{204, 204, 204}, {731, 114}}};
+
+  TinyGpt2Greedy fixture{model};
+  auto& params = fixture.params;
+  params.stop_sequences = &stop_sequences;
+
+  Generators::GreedySearch search{params};
+  Generators::Gpt_State gpt{model, search.sequence_lengths_, params};
+
+  while (!search.IsDone()) {
+    search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+    search.SelectTop();
+  }
+
+  ASSERT_TRUE(search.GetSequenceLength() == 7);
+  for (int i = 0; i < params.batch_size; i++) {
+    auto sequence = search.sequences_.GetSequence(i);
+    ASSERT_TRUE(std::equal(expected_output.begin() + i * 7, expected_output.begin() + (i + 1) * 7, sequence.begin(), sequence.end()));
+  }
+
+  std::cout << "Test_GreedySearchTest_GptStopSequences complete\r\n";
+}
+
+void Test_BeamSearchTest_StopSequences() {
+
+  // Both beams get the same logits, favouring token 1, then 2, then 0. Beam 0 completes the stop sequence {1, 2} on the
+  // second step, the finished hypothesis keeps it whole and beats the beams that carry on to max_length.
+  std::vector<int32_t> input_ids{0};
+  std::vector<std::vector<Generators::ScoreType>> step_logits{
+      {0.0f, 5.0f, 0.0f, -10.0f, 0.0f, 5.0f, 0.0f, -10.0f},
+      {0.0f, 0.0f, 5.0f, -10.0f, 0.0f, 0.0f, 5.0f, -10.0f},
+      {5.0f, 0.0f, 0.0f, -10.0f, 5.0f, 0.0f, 0.0f, -10.0f},
+      {5.0f, 0.0f, 0.0f, -10.0f, 5.0f, 0.0f, 0.0f, -10.0f}};
+  std::vector<int32_t> expected_output{0, 1, 2, 3, 3};
+
+  Generators::StopSequences stop_sequences{{{1, 2}}};
+
+  Generators::SearchParams params;
+  params.max_length = 5;
+  params.batch_size = 1;
+  params.sequence_length = 1;
+  params.input_ids = input_ids;
+  params.vocab_size = 4;
+  params.eos_token_id = params.pad_token_id = 3;
+  params.num_beams = 2;
+  params.stop_sequences = &stop_sequences;
+
+  Generators::BeamSearch search{params};
+  while (!search.IsDone()) {
+    search.SetLogits(step_logits[search.GetSequenceLength() - 1]);
+    search.SelectTop();
+  }
+
+  std::vector<int32_t> output_sequence(params.max_length);
+  std::vector<float> sequence_scores(1);
+  search.Finalize(1, output_sequence, sequence_scores);
+  ASSERT_TRUE(std::equal(expected_output.begin(), expected_output.end(), output_sequence.begin(), output_sequence.end()));
+
+  // The score is of the three tokens of the hypothesis, the length penalty is 1
+  float token_score = -std::log(1.0f + 2.0f * std::exp(-5.0f) + std::exp(-15.0f));
+  ASSERT_TRUE(std::abs(sequence_scores[0] - 2.0f * token_score / 3.0f) < 1e-4f);
+
+  std::cout << "Test_BeamSearchTest_StopSequences complete\r\n";
+}
+
+void Test_GreedySearchTest_GptPerRowParams() {
+
+  // The first row stops at its own max length of 6, padded after that
+  std::vector<int32_t> expected_output{
+      0, 0, 0, 52, 204, 204, 98, 98, 98, 98,
+      0, 0, 195, 731, 731, 114, 114, 114, 114, 114};
+
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+
+  std::vector<int32_t> max_lengths{6, 10}, top_ks{1, 1};
+  std::vector<float> temperatures{0.5f, 2.0f};
+  std::vector<uint32_t> seeds{7, 11};
+
+  TinyGpt2Greedy fixture{model};
+  auto& params = fixture.params;
+  params.max_lengths = max_lengths;
+  params.top_ks = top_ks;
+  params.temperatures = temperatures;
+  params.seeds = seeds;
+
+  auto generate = [&](auto select_top) {
+    Generators::GreedySearch search{params};
+    Generators::Gpt_State gpt{model, search.sequence_lengths_, params};
+    while (!search.IsDone()) {
+      search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+      select_top(search);
+    }
+    auto sequences = search.sequences_.GetSequences();
+    return std::vector<int32_t>(sequences.begin(), sequences.end());
+  };
+
+  // Greedy, then top k sampling with a k of 1 at any temperature is the same
+  ASSERT_TRUE(generate([](Generators::GreedySearch& search) { search.SelectTop(); }) == expected_output);
+  ASSERT_TRUE(generate([](Generators::GreedySearch& search) { search.SampleTopK(50, 1.0f); }) == expected_output);
+
+  // Top p sampling is repeatable with the same seeds
+  auto sample_top_p = [](Generators::GreedySearch& search) { search.SampleTopP(0.9f, 1.0f); };
+  ASSERT_TRUE(generate(sample_top_p) == generate(sample_top_p));
+
+  std::cout << "Test_GreedySearchTest_GptPerRowParams complete\r\n";
+}
+
+void Test_GreedySearchTest_GptPromptBatches() {
+
+  // The second prompt padded further than it needs to be, and a long prompt that would pad out the others
+  std::vector<int32_t> prompt0{0, 0, 0, 52}, prompt1{98, 98, 0, 0, 195, 731};
+  std::vector<int32_t> long_prompt{0, 0, 0, 0, 0, 52, 195, 731, 321, 301, 734, 620};
+  std::vector<std::span<const int32_t>> prompts{long_prompt, prompt0, prompt1};
+
+  auto batches = Generators::MakePromptBatches(prompts, 98, 4, 0.25f);
+  ASSERT_TRUE(batches.size() == 2 && batches[0].sequence_length == 4 && batches[1].sequence_length == 12);
+  ASSERT_TRUE(batches[0].prompt_indices == std::vector<size_t>({1, 2}) && batches[1].prompt_indices == std::vector<size_t>({0}));
+
+  // The first batch is the fixture's two prompts
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH));
+  TinyGpt2Greedy fixture{model};
+  auto& params = fixture.params;
+  batches[0].SetParams(params);
+
+  Generators::GreedySearch search{params};
+  Generators::Gpt_State gpt{model, search.sequence_lengths_, params};
+  while (!search.IsDone()) {
+    search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+    search.SelectTop();
+  }
+
+  ASSERT_TRUE(fixture.IsExpected(search));
+
+  // With no limit on padding, prompt0 goes in one batch with the long prompt and is padded by 8. Its new tokens are the
+  // same as when it's run alone.
+  auto generate = [&](Generators::SearchParams& params) {
+    Generators::GreedySearch search{params};
+    Generators::Gpt_State gpt{model, search.sequence_lengths_, params};
+    while (!search.IsDone()) {
+      search.SetLogits(gpt.Run(search.GetSequenceLength(), search.GetNextTokens()));
+      search.SelectTop();
+    }
+    auto sequences = search.sequences_.GetSequences();
+    return std::vector<int32_t>(sequences.begin(), sequences.end());
+  };
+
+  int new_token_count = 6;
+  auto bucket = Generators::MakePromptBatches(prompts, 98, 4, 1.0f);
+  ASSERT_TRUE(bucket.size() == 1 && bucket[0].sequence_length == 12 && bucket[0].prompt_indices[0] == 1 && bucket[0].prompt_indices.back() == 0);
+  bucket[0].SetParams(params);
+  params.max_length = bucket[0].sequence_length + new_token_count;
+  auto bucket_output = generate(params);
+
+  params.batch_size = 1;
+  params.sequence_length = static_cast<int>(prompt0.size());
+  params.input_ids = prompt0;
+  params.max_length = params.sequence_length + new_token_count;
+  auto alone_output = generate(params);
+
+  ASSERT_TRUE(std::equal(alone_output.begin() + params.sequence_length, alone_output.end(), bucket_output.begin() + bucket[0].sequence_length));
+
+  // Only the columns that are padding in every row go
+  std::vector<int32_t> input_ids{98, 98, 0, 52, 98, 98, 98, 731};
+  int sequence_length = Generators::TrimCommonPadding(input_ids, 2, 4, 98);
+  ASSERT_TRUE(sequence_length == 2 && std::equal(input_ids.begin(), input_ids.begin() + 4, std::vector<int32_t>{0, 52, 98, 731}.begin()));
+
+  std::cout << "Test_GreedySearchTest_GptPromptBatches complete\r\n";
+}
+
+// The tiny Llama model isn't checked in, see "Test models" in the README. Without it the Llama tests are skipped.
+bool HasLlamaModel() {
+  if (std::filesystem::exists(LLAMA_MODEL_PATH))
+    return true;
+  std::cout << "Llama test skipped, " LLAMA_MODEL_PATH " not found\r\n";
+  return false;
+}
+
+void Test_GreedySearchTest_LlamaRunTokens() {
+
+  if (!HasLlamaModel())
+    return;
+
+  // A prompt in two parts, compared with the whole prompt run at once
+  std::vector<int32_t> prompt{1, 450, 4996, 17354, 1576, 3186};
+  std::vector<int32_t> input_ids{prompt.begin(), prompt.begin() + 2};
+  std::vector<int32_t> turn{prompt.begin() + 2, prompt.end()};
+
+  Generators::Llama_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(LLAMA_MODEL_PATH));
+  ASSERT_TRUE(model.logits_uses_seq_len_);
+
+  Generators::SearchParams params;
+  params.max_length = 10;
+  params.batch_size = 1;
+  params.sequence_length = static_cast<int>(prompt.size());
+  params.input_ids = prompt;
+  params.vocab_size = model.GetVocabSize();
+  params.pad_token_id = 0;
+  params.eos_token_id = 2;
+
+  // The prefill only returns the last position's logits, so the logits of each position come from running the prompt up
+  // to it. The whole prompt's state is kept for its continuation.
+  int32_t sequence_length;
+  Generators::Llama_State whole{model, std::span<int32_t>(&sequence_length, 1), params};
+  auto whole_logits = whole.Run(params.sequence_length, {});
+  ASSERT_TRUE(whole_logits.size() == static_cast<size_t>(params.vocab_size));
+
+  std::vector<Generators::ScoreType> expected_logits;  // Of positions 2 to 5
+  for (int length = 3; length < params.sequence_length; length++) {
+    Generators::SearchParams prefix_params = params;
+    prefix_params.sequence_length = length;
+    prefix_params.input_ids = std::span<const int32_t>(prompt.data(), length);
+    Generators::Llama_State prefix{model, std::span<int32_t>(&sequence_length, 1), prefix_params};
+    auto logits = prefix.Run(length, {});
+    expected_logits.insert(expected_logits.end(), logits.begin(), logits.end());
+  }
+  expected_logits.insert(expected_logits.end(), whole_logits.begin(), whole_logits.end());
+
+  params.sequence_length = static_cast<int>(input_ids.size());
+  params.input_ids = input_ids;
+  Generators::Llama_State llama{model, std::span<int32_t>(&sequence_length, 1), params};
+  llama.Run(2, {});
+
+  auto logits_match = [&](std::span<const Generators::ScoreType> logits, const Generators::ScoreType* expected) {
+    for (size_t i = 0; i < logits.size(); i++) {
+      if (std::abs(logits.data()[i] - expected[i]) > 1e-3f)
+        return false;
+    }
+    return true;
+  };
+
+  // Append the rest of the prompt, then roll it back and append it again. The logits are the whole prompt's.
+  for (int i = 0; i < 2; i++) {
+    auto logits = llama.RunTokens(turn, static_cast<int>(turn.size()));
+    ASSERT_TRUE(llama.GetPastLength() == 6 && logits.size() == turn.size() * params.vocab_size);
+    ASSERT_TRUE(logits_match(logits, expected_logits.data()));
+    if (i == 0)
+      llama.Truncate(2);
+  }
+
+  // Back to one token at a time, the same as the whole run's continuation
+  auto* last_logits = expected_logits.data() + 3 * params.vocab_size;
+  int32_t next_token = static_cast<int32_t>(std::max_element(last_logits, last_logits + params.vocab_size) - last_logits);
+  auto next_logits = llama.Run(7, std::span<const int32_t>(&next_token, 1));
+  auto whole_next_logits = whole.Run(7, std::span<const int32_t>(&next_token, 1));
+  ASSERT_TRUE(logits_match(next_logits, whole_next_logits.data()));
+
+  std::cout << "Test_GreedySearchTest_LlamaRunTokens complete\r\n";
+}
+
+void Test_BeamSearchTest_LlamaBeamSearch() {
+  if (!HasLlamaModel())
+    return;
+
+  int32_t max_length = 10;
+  std::vector<int32_t> input_ids{
+      1, 450, 4996, 17354,
+      1, 1576, 3186, 338};
+
+  Generators::Llama_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(LLAMA_MODEL_PATH));
+  ASSERT_TRUE(model.logits_uses_seq_len_);
+
+  Generators::SearchParams params;
+  params.batch_size = 2;
+  params.sequence_length = 4;
+  params.input_ids = input_ids;
+  params.max_length = max_length;
+  params.vocab_size = model.GetVocabSize();
+  params.pad_token_id = 0;
+  params.eos_token_id = -1;  // No EOS, so every beam runs to max_length
+  params.length_penalty = 0.0f;  // A hypothesis' score is then the sum of its tokens' log probabilities
+  params.num_beams = 4;
+
+  // The prefill is broadcast to the beams, and every step picks the past state of the beams that were kept
+  Generators::BeamSearch search{params};
+  Generators::Llama_State llama{model, search.sequence_lengths_, params};
+
+  while (!search.IsDone()) {
+    search.SetLogits(llama.Run(search.GetSequenceLength(), search.GetNextTokens(), search.GetNextIndices()));
+    search.SelectTop();
+  }
+
+  std::vector<int32_t> output_sequence(params.batch_size * max_length);
+  std::vector<float> sequence_scores(params.batch_size);
+  search.Finalize(1, output_sequence, sequence_scores);
+
+  // Rescore each output in a new state, its prompt then the rest of it in one RunTokens. If a beam had picked up another
+  // beam's past state, its score wouldn't match the output.
+  for (int i = 0; i < params.batch_size; i++) {
+    std::span<const int32_t> sequence{output_sequence.data() + i * max_length, static_cast<size_t>(max_length)};
+    ASSERT_TRUE(std::equal(sequence.begin(), sequence.begin() + params.sequence_length, input_ids.begin() + i * params.sequence_length));
+
+    Generators::SearchParams score_params;
+    score_params.batch_size = 1;
+    score_params.sequence_length = params.sequence_length;
+    score_params.input_ids = sequence.subspan(0, params.sequence_length);
+    score_params.max_length = max_length;
+    score_params.vocab_size = model.GetVocabSize();
+
+    // The logits of the prompt's last position, then of every position after it but the last
+    std::vector<int32_t> sequence_lengths(1);
+    Generators::Llama_State score_llama{model, sequence_lengths, score_params};
+    auto prompt_logits = score_llama.Run(params.sequence_length, {});
+    std::vector<Generators::ScoreType> logits{prompt_logits.begin(), prompt_logits.end()};
+    auto continuation = sequence.subspan(params.sequence_length, max_length - 1 - params.sequence_length);
+    auto continuation_logits = score_llama.RunTokens(continuation, static_cast<int>(continuation.size()));
+    logits.insert(logits.end(), continuation_logits.begin(), continuation_logits.end());
+
+    float score = 0.0f;
+    for (int j = params.sequence_length; j < max_length; j++) {
+      auto* position_logits = logits.data() + (j - params.sequence_length) * params.vocab_size;  // Scoring token j
+      float max_logit = *std::max_element(position_logits, position_logits + params.vocab_size);
+      float sum = 0.0f;
+      for (int k = 0; k < params.vocab_size; k++)
+        sum += std::exp(position_logits[k] - max_logit);
+      score += position_logits[sequence.data()[j]] - max_logit - std::log(sum);
+    }
+    ASSERT_TRUE(std::abs(score - sequence_scores[i]) < 1e-3f * std::max(1.0f, std::abs(score)));
+  }
+
+  std::cout << "Test_BeamSearchTest_LlamaBeamSearch complete\r\n";
+}
+
 #if USE_CUDA
 void Test_GreedySearchTest_GptGreedySearchFp32_Cuda() {
   std::vector<int64_t> input_ids_shape{2, 4};
@@ -139,7 +1290,7 @@ void Test_GreedySearchTest_GptGreedySearchFp32_Cuda() {
   // To generate this file:
   // python convert_generation.py --model_type gpt2 -m hf-internal-testing/tiny-random-gpt2 --output tiny_gpt2_greedysearch_fp16.onnx --use_gpu --max_length 20
   // And copy the resulting gpt2_init_past_fp32.onnx file into these two files (as it's the same for gpt2)
-  Generators::Gpt_Model model{*g_ort_env, ORT_TSTR_ON_MACRO(MODEL_PATH "hf-internal-testing/tiny-random-gpt2_past_fp32.onnx"), cuda_stream};
+  Generators::Gpt_Model model{*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH), cuda_stream};
 
   Generators::SearchParams_Cuda params;
   params.batch_size = static_cast<int>(input_ids_shape[0]);
@@ -201,7 +1352,7 @@ void Test_BeamSearchTest_GptBeamSearchFp32_Cuda() {
   //        --output tiny_gpt2_beamsearch_fp16.onnx --use_gpu --max_length 20
   // (with separate_gpt2_decoder_for_init_run set to False as it is now set to True by default)
 
-  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(MODEL_PATH "hf-internal-testing/tiny-random-gpt2_past_fp32.onnx"), cuda_stream);
+  Generators::Gpt_Model model(*g_ort_env, ORT_TSTR_ON_MACRO(TINY_GPT2_PATH), cuda_stream);
 
   Generators::SearchParams_Cuda params;
   params.batch_size = static_cast<int>(input_ids_shape[0]);